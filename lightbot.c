@@ -1,55 +1,205 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
 #include <signal.h>
 #include <ctype.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/uio.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
 #include <unistd.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <netdb.h>
+#include <pthread.h>
 
 #define BOT_NICK    "CrappyBot"
 #define BOT_PORT    6667
 #define BOT_SERVER  "irc.freenode.net"
-#define BOT_CHANNEL "#test" /* only one channel supported right now */
 
 #define BUFFER_SIZE  4096
-#define HEADER_PING           "PING :"
-#define HEADER_PONG           "PONG :"
+#define RECV_MAX     (BUFFER_SIZE * 4)
+#define HEADER_PING           "PING"
+#define HEADER_PONG           "PONG"
 #define HEADER_PRIVMSG        "PRIVMSG"
 #define HEADER_JOIN           "JOIN"
 #define HEADER_PART           "PART"
 #define HEADER_KICK           "KICK"
+#define HEADER_NICK           "NICK"
+#define HEADER_QUIT           "QUIT"
+#define HEADER_MODE           "MODE"
 #define HEADER_NAMES          "NAMES"
 
-#define NICK_MAX     50
-#define IDENT_MAX    50
-#define CHANNEL_MAX  50
+#define RPL_WELCOME           "001"
+#define RPL_ISUPPORT          "005"
+#define RPL_NAMREPLY          "353"
+#define RPL_ENDOFNAMES        "366"
+#define ERR_NOSUCHCHANNEL     "403"
+#define ERR_TOOMANYCHANNELS   "405"
+#define ERR_CHANNELISFULL     "471"
+#define ERR_INVITEONLYCHAN    "473"
+#define ERR_BANNEDFROMCHAN    "474"
+#define ERR_BADCHANNELKEY     "475"
+
+#define IRC_PARAMS_MAX 15
+
+/* identity limits until the server sends RPL_ISUPPORT */
+#define NICKLEN_DEFAULT     30
+#define USERLEN_DEFAULT     16
+#define HOSTLEN_DEFAULT     63
+#define CHANNELLEN_DEFAULT  200
+#define CASEMAP_DEFAULT     CASEMAP_RFC1459
+#define KEY_MAX             LINE_MAX /* folded probe, on the stack */
+#define ACL_MASK_MAX        128 /* IRC_PRIV masks, longer ones never match */
+#define CHANTYPES_DEFAULT   "#&"
+#define PREFIX_DEFAULT      "(ov)@+"
+#define CHANMODES_DEFAULT   "beI,k,l,imnpst"
 #define MESSAGE_MAX  2048
 
-#define SH_READ_MAX 256
-
+#define SH_CMD_MAX     512
+#define SH_OUTPUT_MAX  4096  /* bytes of output kept per job */
+#define SH_LINES_MAX   8     /* output lines replied */
+#define SH_JOBS_MAX    4     /* children running at once */
+#define SH_TIMEOUT     10000 /* ms before a job gets killed */
+#define SH_UPTIME      "uptime" /* !uptime, nothing from IRC reaches the shell */
+
+#define LINE_MAX        512  /* including CRLF */
+#define TMPL_SEGS       16   /* pieces per reply template */
+#define FLOOD_BUCKETS   8    /* sliding window resolution */
+#define SENDQ_BURST     5    /* lines the server lets through at once */
+#define SENDQ_INTERVAL  2000 /* ms to earn back one line */
+#define SENDQ_IOV       16   /* lines handed to one sendmsg */
+#define MODES_DEFAULT   3    /* parameter modes per MODE line */
+
+#define PING_INTERVAL   120000 /* ms of silence before we ping the server */
+#define PING_TIMEOUT    240000 /* ms of silence before we give up */
+#define RECONNECT_MIN   1000   /* ms before the first retry, doubled per failure */
+#define RECONNECT_MAX   300000 /* ms at most between retries */
+#define RECONNECT_TRIES 0      /* failures in a row before giving up, 0 never */
+#define CONNECT_STAGGER 250    /* ms before the next address is tried alongside */
+#define CONNECT_TIMEOUT 10000  /* ms for all addresses together */
+#define CONNECT_MAX     4      /* connects in flight */
+#define EVLOOP_EVENTS   64
+#define EVLOOP_SHARDS   0      /* event loop threads, 0 for one per core */
+
+#define BOT_STORE       "lightbot.%s.db"   /* bans and channel settings, per network */
+#define STORE_JOURNAL   ".journal"
+#define STORE_OLD       ".journal.old"     /* while compacting */
+#define STORE_TMP       ".tmp"
+#define STORE_PATH_MAX  256
+#define STORE_COMPACT   (256 * 1024)       /* journal bytes before compaction */
+#define STORE_REC_MAX   4096
+
+#define BOT_CONTROL     "lightbot.sock"    /* metrics to whoever connects */
+
+#define REPLAY_CHUNK    BUFFER_SIZE /* bytes fed per simulated recv */
+#define HIST_BUCKETS    256
+#define ARENA_SIZE      (LINE_MAX * 4) /* grows to the biggest line seen */
+
+#ifndef DEBUG
 #define DEBUG 1
+#endif
 
 #define LENGTH(X)             (sizeof X / sizeof X[0])
 
-static char MODE_NAME[ BUFFER_SIZE ];
-int IRC_SOCKET = 0;
-
 typedef enum
 { RETURN_OK = 0, RETURN_FAIL, RETURN_NOTHING
 } eRETURN;
 
+/* identifier folded by CASEMAPPING, compared as hash, length, bytes */
+typedef struct
+{
+   uint32_t    hash;
+   size_t      len;
+   const char *name;
+} casekey_t;
+
+/* Strings point into the line being handled, or into the storage of
+ * the record holding the user_info. Never NULL, "" when unknown. */
 typedef struct
 {
-   char nick[ NICK_MAX ];
-   char ident[ IDENT_MAX ];
-   char channel[ CHANNEL_MAX ];
+   const char *nick;
+   const char *ident;
+   const char *host;
+   const char *channel;
+   uint8_t     privs;   /* USR_* granted by IRC_PRIV, filled where the sender is resolved */
+   const casekey_t *nkey, *ckey; /* nick and channel folded by msgtouser, NULL elsewhere */
 } user_info;
 
+/* CASEMAPPING, how the server compares nicks and channels */
+typedef enum
+{ CASEMAP_ASCII = 0, CASEMAP_RFC1459, CASEMAP_STRICT, CASEMAP_MAX
+} eCASEMAP;
+
+/* on-disk store, a snapshot plus a write-ahead journal of changes.
+ * Both are a storehdr_t followed by records: a storerec_t and the
+ * record's NUL terminated strings, padded to 4 bytes.
+ *    STORE_CHAN   channel
+ *    STORE_BAN    channel mask reason nick ident host
+ *    STORE_UNBAN  channel mask */
+#define STORE_MAGIC    0x4244424cu /* "LBDB" */
+#define STORE_VERSION  1
+
+typedef enum
+{ STORE_CHAN = 1, STORE_BAN, STORE_UNBAN
+} eSTORE;
+
+typedef struct
+{
+   uint32_t magic, version;
+} storehdr_t;
+
+typedef struct
+{
+   uint16_t type;
+   uint16_t size;  /* header and strings */
+   uint32_t flags; /* STORE_CHAN */
+} storerec_t;
+
+/* RPL_ISUPPORT, what the server told us about its limits */
+typedef struct
+{
+   size_t nicklen, userlen, hostlen, channellen;
+   size_t modes;                 /* parameter modes per MODE, 0 no limit */
+   size_t maxjoin, maxpart;      /* TARGMAX, 0 no limit */
+   char   chantypes[ 16 ];
+   char   prefixmodes[ 16 ];     /* PREFIX=(ov)@+ */
+   char   prefixes[ 16 ];
+   char   chanmodes[ 4 ][ 32 ];  /* CHANMODES=A,B,C,D */
+   uint8_t casemap;              /* eCASEMAP */
+} isupport_t;
+
+/* tokenized line, all strings point into the line buffer */
+typedef struct
+{
+   char   *nick;     /* prefix, NULL if not sent */
+   char   *ident;    /* NULL for server prefix */
+   char   *host;
+   char   *command;
+   char   *params[ IRC_PARAMS_MAX ];
+   size_t  nparams;  /* trailing param is last when present */
+} ircmsg_t;
+
+typedef void msg_func( const ircmsg_t* );
+typedef struct
+{
+   const char *command;
+   msg_func   *function;
+} handler_t;
+
 typedef void cmd_func( const user_info*, const char* );
 typedef struct
 {
@@ -61,50 +211,590 @@ typedef struct
 typedef void join_func( const user_info* );
 typedef struct
 {
-   const char *nick;
-   const char *ident;
+   const char *mask;    /* nick!ident@host, wildcards allowed */
    const char *priv;
    join_func  *joinfunc;
    join_func  *partfunc;
 } user_t;
 
+typedef void line_func( char* );
+typedef struct
+{
+   char    data[ RECV_MAX + 1 ];
+   size_t  head;    /* first unconsumed byte */
+   size_t  scan;    /* searched for newline up to here */
+   size_t  tail;    /* end of received data */
+   uint8_t discard; /* skipping rest of an overlong line */
+} recvbuf_t;
+
+/* fixed size object pool, objects are carved from slabs */
+typedef struct
+{
+   size_t  size;   /* object size */
+   size_t  count;  /* objects per slab */
+   size_t  live;   /* objects handed out */
+   size_t  want;   /* size to take once nothing is handed out, 0 none */
+   void   *free;   /* free list, linked through the objects */
+   void  **slabs;
+   size_t  nslabs;
+} pool_t;
+#define POOL_INIT(type, count) { sizeof(type) < sizeof(void*) ? sizeof(void*) : sizeof(type), count, 0, 0, NULL, NULL, 0 }
+
+/* bump allocator for what one line needs while it is handled */
+typedef union
+{
+   long double ld;
+   void       *p;
+   long long   ll;
+} arenaalign_t;             /* the strictest of what goes in */
+
+typedef struct arenablk_t
+{
+   struct arenablk_t *next;  /* older, full blocks */
+   size_t             size, used;
+   arenaalign_t       data[]; /* the header is padded up to it */
+} arenablk_t;
+
+typedef struct
+{
+   arenablk_t *blk;
+   size_t      total;       /* of all blocks */
+} arena_t;
+
+/* event loop, fd watches and timers */
+typedef struct watch_t watch_t;
+typedef void io_func( watch_t *w, uint32_t events );
+struct watch_t
+{
+   int      fd;
+   io_func *function;
+   void    *data;
+   uint32_t events;
+   uint8_t  added;
+};
+
+typedef void timer_func( void *data );
+typedef struct
+{
+   uint64_t    when;     /* ms */
+   size_t      slot;     /* index in the heap */
+   timer_func *function;
+   void       *data;
+} evtimer_t;
+
+typedef void tick_func( void *data );
+typedef struct
+{
+   int         epfd;
+   evtimer_t **heap;     /* min heap on when */
+   size_t      ntimers, cap;
+   tick_func  *tick;     /* runs before every wait */
+   void       *data;
+   pool_t      timers;
+   pthread_mutex_t *lock; /* held except while waiting, NULL for none */
+   uint8_t     running;
+} evloop_t;
+
+static evloop_t IRC_LOOP;    /* main thread, signals and control */
+static watch_t IRC_SIGNAL;   /* signalfd */
+static watch_t IRC_DONE;     /* eventfd, counts shards that stopped */
+
+/* one network, everything its handlers touch; IRC_CONN while handling */
+typedef struct ircconn_t ircconn_t;
+typedef struct shard_t shard_t;
+static __thread ircconn_t *IRC_CONN = NULL;
+
+/* subprocess, output streams in through the event loop */
+typedef struct job_t job_t;
+typedef void job_func( job_t *job );
+struct job_t
+{
+   pid_t         pid;
+   watch_t       out;      /* stdout pipe */
+   watch_t       proc;     /* pidfd, readable once the child exits */
+   evtimer_t    *timeout;
+   job_func     *done;
+   user_info     user;     /* who asked */
+   char          who[ LINE_MAX ]; /* user strings, they came in one line */
+   char          cmd[ SH_CMD_MAX ];
+   char          output[ SH_OUTPUT_MAX + 1 ]; /* sh_reply terminates the last line */
+   size_t        len;
+   int           status;
+   size_t        slot;     /* in jobs_running */
+   uint64_t      started;  /* ns */
+   ircconn_t    *conn;
+   uint8_t       eof, exited, killed, truncated;
+   struct job_t *next;     /* pending queue */
+};
+
+static watch_t IRC_CONTROL = { -1, NULL, NULL, 0, 0 };
+
+/* latency histogram, 4 buckets per power of two nanoseconds */
+typedef struct
+{
+   uint64_t count, sum, max;
+   uint64_t bucket[ HIST_BUCKETS ];
+} hist_t;
+
+typedef enum
+{ STAGE_RECV = 0, STAGE_FRAME, STAGE_PARSE, STAGE_DISPATCH, STAGE_FLUSH, STAGE_MAX
+} eSTAGE;
+
+static const char *STAGE_NAME[ STAGE_MAX ] = { "recv", "frame", "parse", "dispatch", "flush" };
+static uint8_t IRC_STATS = 1; /* time the hot path */
+
+/* counters next to the stage histograms, see metrics_write */
+typedef struct
+{
+   uint64_t recv_bytes, recv_calls;
+   uint64_t usr_hits, usr_misses;
+   uint64_t ban_checks, ban_hits;
+   uint64_t sent_lines, sent_bytes, send_calls, sendq_max;
+   uint64_t jobs_started, jobs_killed, jobs_failed;
+   uint64_t flood_warns, flood_drops, flood_kicks, flood_bans;
+   uint64_t reconnects;
+   hist_t   usr_lookup, ban_check, sendq_wait, job_time;
+} metrics_t;
+
+typedef struct
+{
+   uint64_t allocs, reallocs, frees;
+} memstat_t;
+static memstat_t IRC_MEM; /* all threads, counted atomically */
+
+/* outbound lines kept in memory instead of sent */
+typedef struct
+{
+   char    *data;
+   size_t   len, cap;
+   uint64_t lines;
+} capture_t;
+
+/* open addressing hash map with linear probing */
+typedef struct
+{
+   uint32_t  hash;
+   void     *value; /* NULL when empty */
+} hslot_t;
+
+typedef struct
+{
+   hslot_t *slots;
+   size_t   mask;   /* capacity - 1 */
+   size_t   count;
+} hmap_t;
+typedef int hmap_eq( const void *value, const void *key );
+typedef int hmap_keep( void *value, const void *ctx );
+
+/* one part of a nick!ident@host mask */
+typedef enum
+{ MATCH_ANY = 0, MATCH_EXACT, MATCH_SUFFIX, MATCH_GLOB
+} eMATCH;
+
+typedef struct
+{
+   uint8_t     type;
+   const char *pat; /* points into ban_t.pat, suffix without the '*' */
+} matcher_t;
+
+typedef enum
+{ MASK_NICK = 0, MASK_IDENT, MASK_HOST, MASK_PARTS
+} eMASK;
+
+/* ban indexes, the most selective literal part of a mask is indexed */
+typedef enum
+{ BAN_NICK = 0, BAN_IDENT, BAN_HOST, BAN_SUFFIX, BAN_GLOB
+} eBANIDX;
+
 typedef struct ban_t
 {
-   user_info    *user;
-   char         *reason;
-   struct ban_t *next;
+   user_info     user;   /* who got banned, empty nick for plain masks */
+   casekey_t     vkey;   /* user.nick folded */
+   char         *reason; /* start of the one block holding all strings */
+   char         *text;
+   char         *pat;
+   matcher_t     match[ MASK_PARTS ]; /* folded */
+   uint8_t       index;
+   struct ban_t *next;   /* same index key */
+   struct ban_t *vnext;  /* same banned nick */
 } ban_t;
-static ban_t *IRC_BAN = NULL;
 
+/* IRC_PRIV entry compiled like a ban, folded */
+typedef struct
+{
+   ban_t   mask;
+   uint8_t privs;  /* USR_* from the priv string */
+   uint8_t ok;
+   char    pat[ ACL_MASK_MAX + 5 ], text[ ACL_MASK_MAX + 5 ];
+} aclent_t;
+
+typedef struct
+{
+   hmap_t  index;   /* (eBANIDX, key) -> chain of bans */
+   hmap_t  victims; /* banned nick -> chain of bans */
+   ban_t  *glob;    /* masks that have to be walked */
+   size_t  count;
+} banlist_t;
+
+typedef struct
+{
+   uint8_t     index;
+   const char *key;
+} bankey_t;
+
+/* outbound lines */
+typedef enum
+{ PRIO_URGENT = 0, PRIO_MODERATION, PRIO_BULK, PRIO_MAX
+} ePRIO;
+
+typedef struct sendline_t
+{
+   struct sendline_t *next;
+   size_t             len;
+   uint64_t           queued; /* ms */
+   char               line[ LINE_MAX + 1 ];
+} sendline_t;
+
+/* bulk lines wait per target, targets are served round robin */
+typedef struct sendtarget_t
+{
+   sendline_t          *head, *tail;
+   struct sendtarget_t *next; /* next target with lines waiting */
+   char                 name[]; /* pool sized from ISUPPORT */
+} sendtarget_t;
+
+typedef struct
+{
+   sendline_t   *head[ PRIO_BULK ], *tail[ PRIO_BULK ];
+   sendtarget_t *first, *last; /* round robin of bulk targets */
+   hmap_t        targets;      /* name -> sendtarget_t */
+   int64_t       budget;       /* token bucket, in ms of send time */
+   uint64_t      stamp;        /* last refill */
+   size_t        depth;
+   sendline_t   *batch[ SENDQ_IOV ]; /* popped, written with one syscall */
+   size_t        nbatch;
+   size_t        offset;       /* bytes of batch[0] already sent */
+   uint8_t       blocked;      /* socket would block, wait for EPOLLOUT */
+   uint8_t       unpaced;      /* replay, no token bucket */
+} sendq_t;
+
+/* channel settings */
+#define CHAN_AUTOJOIN  0x1 /* join on connect */
+#define CHAN_WELCOME   0x2 /* greet joins and parts */
+#define CHAN_AUTOOP    0x4 /* op privileged users */
+
+typedef struct
+{
+   const char *network; /* NULL for every network */
+   const char *name;
+   uint32_t    flags;
+} chanconf_t;
+
+/* network to connect to */
+typedef struct
+{
+   const char *name;    /* store file and metrics label */
+   const char *server;
+   int         port;
+   const char *nick;
+} netconf_t;
+
+typedef enum
+{ CHAN_PARTED = 0, CHAN_JOINING, CHAN_JOINED, CHAN_PARTING
+} eCHAN;
+
+struct usr_t;
+
+/* one queued +o nick, flushed as MODE #chan +ooo a b c */
+typedef struct pendmode_t
+{
+   struct pendmode_t *next;
+   uint32_t           hash;     /* of the folded nick */
+   char               sign, mode;
+   char               nick[];   /* pool sized from ISUPPORT */
+} pendmode_t;
+
+typedef struct chan_t
+{
+   char          *name;
+   casekey_t      key;      /* folded name, same allocation */
+   uint8_t        state;
+   uint32_t       flags;
+   banlist_t      bans;
+   struct usr_t  *members;
+   size_t         nmembers;
+   struct chan_t *batch;    /* next channel in the JOIN/PART batch */
+   pendmode_t    *modes, *modes_tail;
+   struct chan_t *mbatch;   /* next channel with modes queued */
+   uint8_t        mqueued;
+   char          *names;    /* 353 text staged until 366 */
+   size_t         nameslen, namescap, nnames;
+} chan_t;
+
+/* channel prefix modes, from the PREFIX the server sends */
+#define USR_OP      0x1 /* +o or above */
+#define USR_HALFOP  0x2
+#define USR_VOICE   0x4
+#define USR_NEW     0x40 /* linked by the NAMES being loaded */
+#define USR_SEEN    0x80 /* in the NAMES being loaded */
+
+/* inbound events that are rate limited, the ones before FLOOD_JOIN
+ * are counted on the membership */
+typedef enum
+{ FLOOD_COMMAND = 0, FLOOD_LINE, FLOOD_JOIN, FLOOD_MAX
+} eFLOOD;
+
+/* what to do once a threshold is reached, 0 is off */
+typedef struct
+{
+   uint8_t  kind;
+   uint32_t window;           /* ms */
+   uint8_t  warn, drop, kick, ban;
+} floodconf_t;
+
+/* window split in FLOOD_BUCKETS, the oldest buckets fall out as time moves */
+typedef struct
+{
+   uint32_t last;             /* bucket of the newest event */
+   uint16_t sum;
+   uint8_t  bucket[ FLOOD_BUCKETS ];
+} floodwin_t;
+
+/* someone with no membership to count on: joins and parts outlive it,
+ * private messages have none. By channel and nick!ident@host. */
+typedef struct
+{
+   uint64_t   id;             /* floodid() */
+   uint64_t   seen;           /* ms of the newest event, swept once idle */
+   floodwin_t win[ FLOOD_MAX ];
+} floodrec_t;
+
+/* someone on the network, once however many channels we share */
+typedef struct nick_t
+{
+   casekey_t     key;         /* folded nick, in data */
+   const char   *nick, *ident, *host; /* in data */
+   uint32_t      id;          /* memberships hash on it, survives NICK */
+   uint32_t      acl;         /* IRC_PRIV entries matching, privs from them */
+   uint32_t      aclgen;      /* acl resolved at, 0 after the identity changed */
+   uint8_t       privs;
+   struct usr_t *chans;       /* memberships, through cnext */
+   size_t        nchans;
+   char         *big;         /* the strings when they outgrew data, xmalloc'd */
+   char          data[];      /* nick, ident, host, folded nick; pool sized from ISUPPORT */
+} nick_t;
+
+/* a nick on a channel */
 typedef struct usr_t
 {
-   user_info    *user;
-   struct usr_t *next;
+   user_info     user;          /* strings of the nick_t, channel points to chan->name */
+   nick_t       *nick;
+   chan_t       *chan;
+   uint8_t       modes;         /* USR_OP, ... */
+   struct usr_t *prev, *next;   /* channel members */
+   struct usr_t *cprev, *cnext; /* channels of the nick */
+   floodwin_t    flood[ FLOOD_JOIN ]; /* commands and lines here */
 } usr_t;
-static usr_t *IRC_USR = NULL;
 
-/* split funcs */
+/* command word as typed, not terminated */
+typedef struct
+{
+   const char *word;
+   size_t      len;
+} cmdkey_t;
+
+/* MSG_CMD by command word, built once in cmd_init */
+static hmap_t IRC_CMD = { NULL, 0, 0 };
+static uint8_t IRC_CMD_FIRST[ 256 / 8 ]; /* bytes a command can start with */
+
+/* reply template placeholders */
+typedef enum
+{ VAR_NICK = 0, VAR_IDENT, VAR_HOST, VAR_CHANNEL, VAR_TARGET, VAR_REASON, VAR_COMMAND, VAR_HELP, VAR_MAX
+} eVAR;
+
+typedef enum
+{ REPLY_HELP = 0, REPLY_HELP_LINE, REPLY_TEST, REPLY_WELCOME, REPLY_GOODBYE, REPLY_UNBANNED,
+  REPLY_KICK, REPLY_BANNED, REPLY_TIMEOUT, REPLY_TRUNCATED, REPLY_FLOOD, REPLY_FLOODED, REPLY_MAX
+} eREPLY;
+
+typedef struct
+{
+   uint8_t     id;
+   const char *text;
+} reply_t;
+
+/* literals point into the reply_t text */
+typedef struct
+{
+   const char *text;
+   uint16_t    len;
+   uint8_t     var;    /* VAR_MAX for a literal */
+} tmplseg_t;
+
+typedef struct
+{
+   tmplseg_t seg[ TMPL_SEGS ];
+   size_t    nseg;
+   size_t    fixed;    /* literal bytes */
+   uint32_t  vars;     /* placeholders used, 1 << eVAR */
+} tmpl_t;
+
+/* registry key */
+typedef struct
+{
+   const struct chan_t *chan;
+   const struct nick_t *nick;
+} usrkey_t;
+
+
+/* split funcs, the pieces live until the line is done */
 static int strsplit(char ***dst, const char *str, const char *token);
-static void strsplit_clear(char ***dst);
 
-/* replace func (check for NULL, and remember free if !NULL) */
-static char *str_replace(const char *s, const char *old, const char *new);
+/* reply template funcs */
+static int tmpl_init(void);
+static int tmpl_compile( tmpl_t *t, const char *text );
+static size_t tmpl_expand( char *dst, size_t room, const tmpl_t *t, const char **vars );
+
+/* ban engine funcs */
+static ban_t* banlist_add( banlist_t *bl, const char *mask, const user_info *user, const char *reason );
+static ban_t* banlist_find( const banlist_t *bl, const user_info *user );
+static ban_t* banlist_mask( const banlist_t *bl, const char *mask );
+static ban_t* banlist_victim( const banlist_t *bl, const char *nick );
+static int banlist_link( banlist_t *bl, ban_t *b );
+static void banlist_del( banlist_t *bl, ban_t *b );
+static void banlist_clear( banlist_t *bl );
+static void banlist_rekey( banlist_t *bl );
+
+/* privilege funcs, IRC_PRIV compiled per connection */
+static void acl_compile(void);
+static uint32_t acl_match( const user_info *user );
+static uint8_t acl_privs( uint32_t acl );
+static uint8_t usrprivs( usr_t *u );
+
+/* allocation funcs, counted for the replay report */
+static void* xmalloc( size_t size );
+static void* xcalloc( size_t count, size_t size );
+static void* xrealloc( void *ptr, size_t size );
+static void xfree( void *ptr );
+
+/* store funcs */
+static void store_open(void);
+static void store_chan( const chan_t *c );
+static void store_ban( const char *channel, const ban_t *b );
+static void store_unban( const char *channel, const ban_t *b );
+static void store_close(void);
+
+/* stat funcs */
+static uint64_t now_ns(void);
+static void metrics_write( FILE *f );
+static void hist_add( hist_t *h, uint64_t ns );
+static uint64_t hist_pct( const hist_t *h, double pct );
+static void capture( capture_t *c, const char *line, size_t len );
+static int replay( const char *path, unsigned loops, const char *out );
+
+/* pool funcs */
+static void* pool_alloc( pool_t *pool );
+static void pool_free( pool_t *pool, void *obj );
+static void pool_clear( pool_t *pool );
+static void pool_resize( pool_t *pool, size_t size );
+
+/* casemap funcs */
+static void casemap_init(void);
+static void casekey( casekey_t *k, char *buf, size_t size, const char *s );
+static int keyeq( const casekey_t *a, const casekey_t *b );
+static int isme( const char *nick );
+static const casekey_t* nickkey( const user_info *user, casekey_t *k, char *buf );
+static const casekey_t* chankey( const user_info *user, casekey_t *k, char *buf );
+static void rekey(void);
+
+/* arena funcs */
+static void* arena_alloc( arena_t *arena, size_t size );
+static void arena_reset( arena_t *arena );
+static void arena_clear( arena_t *arena );
+
+/* hash map funcs */
+static uint32_t strhash( uint32_t hash, const char *str );
+static void* hmap_get( const hmap_t *map, uint32_t hash, hmap_eq *eq, const void *key );
+static int hmap_put( hmap_t *map, uint32_t hash, void *value );
+static void* hmap_del( hmap_t *map, uint32_t hash, hmap_eq *eq, const void *key );
+static int hmap_reserve( hmap_t *map, size_t count );
+static void hmap_sweep( hmap_t *map, hmap_keep *keep, const void *ctx );
+static void hmap_clear( hmap_t *map );
+
+/* event loop funcs */
+static int evloop_init( evloop_t *loop );
+static int evloop_watch( evloop_t *loop, watch_t *w, uint32_t events );
+static void evloop_unwatch( evloop_t *loop, watch_t *w );
+static evtimer_t* evloop_timer( evloop_t *loop, uint64_t ms, timer_func *function, void *data );
+static void evloop_cancel( evloop_t *loop, evtimer_t *t );
+static void evloop_run( evloop_t *loop );
+static void evloop_free( evloop_t *loop );
+
+/* send queue funcs */
+static uint64_t now_ms(void);
+static void sendq_printf( sendq_t *q, uint8_t prio, const char *target, const char *fmt, ... );
+static void sendq_push( sendq_t *q, uint8_t prio, const char *target, sendline_t *l, size_t len );
+static int sendq_flush( sendq_t *q, int fd );
+static void sendq_clear( sendq_t *q );
+
+/* connection funcs */
+static ircconn_t* connenter( ircconn_t *c );
+static void connclose( ircconn_t *c );
+static void connretry( void *data );
+static int connup( ircconn_t *c );
+static int ircconnect( ircconn_t *c );
+static void dialnext( ircconn_t *c );
+static void dialclear( ircconn_t *c );
+static void connresolved( watch_t *w, uint32_t events );
+
+/* receive buffer funcs */
+static char* recvbuf_space( recvbuf_t *rb, size_t *len );
+static ssize_t recvbuf_read( recvbuf_t *rb, int fd );
+static void recvbuf_drain( recvbuf_t *rb, line_func *func );
+
+/* tokenizer */
+static int ircparse( ircmsg_t *msg, char *line );
 
 /* helper functions */
 static user_info* getusr( const char *nick, const char *channel );
 static int hasban( const user_info *user );
 static int isop( const user_info *user );
+static int ischannel( const char *name );
+static size_t userlen( const user_info *user );
+static int userpack( user_info *dst, char *buf, size_t size, const user_info *src );
+static int modeparam( char mode, int set );
+static void isupport_reset(void);
 static void say( const char *message, const char *target );
-static void say_highlight( const char *message, const user_info *user );
+static void uservars( const char **vars, const user_info *user );
+static void reply( uint8_t prio, const char *target, uint8_t id, const char **vars, const char *fmt, ... );
+static void say_reply( uint8_t id, const char *target, const char **vars );
+static void kick_reply( const user_info *user, uint8_t id, const char *reason );
+static int flood( const user_info *user, uint8_t kind );
 static void set_mode( const user_info *user, const char *level );
 static void set_mode_channel( const char *channel, const char *level );
+static void chanmodeflush( chan_t *c );
 static void set_topic( const char *channel, const char *topic );
 static void kick( const user_info *user, const char *reason );
 static void ban( const user_info *user, const char *reason );
+static void banmask( const char *mask, const char *channel, const char *reason );
 static void unban( const user_info *user );
-static size_t sh_run( const char *cmd, char output[][SH_READ_MAX], size_t lines );
+static void unbanarg( const char *arg, const char *channel );
+static int sh_run( const char *cmd, const user_info *user, job_func *done );
+static void sh_reply( job_t *job );
+
+/* channel funcs */
+static chan_t* chanfind( const casekey_t *k );
+static chan_t* getchan( const char *name );
+static chan_t* userchan( const user_info *user );
+static chan_t* addchan( const char *name, uint32_t flags );
+static int unbatch( chan_t **batch, chan_t *c );
+static void joinchannel( const char *channel );
+static void partchannel( const char *channel );
+static void dropnames( chan_t *c );
 
 /* cmds */
+static void cmd_join( const user_info *user, const char *message );
+static void cmd_part( const user_info *user, const char *message );
 static void cmd_test( const user_info *user, const char *message );
 static void cmd_kick( const user_info *user, const char *message );
 static void cmd_ban( const user_info *user, const char *message );
@@ -113,6 +803,7 @@ static void cmd_op( const user_info *user, const char *message );
 static void cmd_deop( const user_info *user, const char *message );
 static void cmd_help( const user_info *user, const char *message );
 static void cmd_topic( const user_info *user, const char *message );
+static void cmd_uptime( const user_info *user, const char *message );
 
 /* define cmds */
 static const command_t MSG_CMD[] =
@@ -126,26 +817,203 @@ static const command_t MSG_CMD[] =
    { "!ban",  cmd_ban,     "Ban" },
    { "!deop", cmd_deop,    "Deop" },
    { "!op", cmd_op,        "Op" },
+   { "!join", cmd_join,    "Join" },
+   { "!part", cmd_part,    "Part" },
+   { "!uptime", cmd_uptime, "Uptime" },
+};
+
+/* define networks */
+static const netconf_t IRC_NETWORKS[] =
+{
+   /* NAME, SERVER, PORT, NICK */
+   { "freenode", BOT_SERVER, BOT_PORT, BOT_NICK },
+};
+
+/* define channels */
+static const chanconf_t IRC_CHANNELS[] =
+{
+   /* NETWORK (NULL ALL), CHANNEL, SETTINGS */
+   { NULL, "#test", CHAN_AUTOJOIN | CHAN_WELCOME | CHAN_AUTOOP },
+};
+
+/* define replies, {nick} {ident} {host} {channel} {target} {reason} {command} {help} */
+static const reply_t IRC_REPLIES[] =
+{
+   /* REPLY, TEMPLATE */
+   { REPLY_HELP,      "Commands:" },
+   { REPLY_HELP_LINE, "{command} - {help}" },
+   { REPLY_TEST,      "{nick}: Hello World!" },
+   { REPLY_WELCOME,   "{nick}: Welcome!" },
+   { REPLY_GOODBYE,   "{nick}: Goodbye!" },
+   { REPLY_UNBANNED,  "* Unbanned {target}" },
+   { REPLY_KICK,      "{reason}" },
+   { REPLY_BANNED,    "You are banned" },
+   { REPLY_TIMEOUT,   "{nick}: * Timed out" },
+   { REPLY_TRUNCATED, "* Output truncated" },
+   { REPLY_FLOOD,     "{nick}: Slow down" },
+   { REPLY_FLOODED,   "Flooding" },
+};
+
+/* placeholder names by eVAR */
+static const char *TMPL_VARS[ VAR_MAX ] =
+{ "nick", "ident", "host", "channel", "target", "reason", "command", "help" };
+
+/* IRC_REPLIES by id, built once in tmpl_init */
+static tmpl_t IRC_TMPL[ REPLY_MAX ];
+
+/* define flood limits, events per window from one user in one channel */
+static const floodconf_t IRC_FLOOD[] =
+{
+   /* KIND, WINDOW (MS), WARN, DROP, KICK, BAN */
+   { FLOOD_COMMAND, 10000, 4, 5, 10, 0 },
+   { FLOOD_LINE,     5000, 6, 0, 10, 20 },
+   { FLOOD_JOIN,    60000, 4, 0,  0, 8 },
 };
 
 /* define users */
 static const user_t IRC_PRIV[] =
 {
-   /* NICK, IDENT, PRIVILIDGES, JOIN FUNCTION, PART FUNCTION */
-   { "Admin", NULL, "+o", NULL, NULL },
+   /* MASK, PRIVILEGES, JOIN FUNCTION, PART FUNCTION */
+   { "Admin", "+o", NULL, NULL },
+};
+
+/* irc message handlers */
+static void ping( const ircmsg_t *msg );
+static void welcome( const ircmsg_t *msg );
+static void parsemessage( const ircmsg_t *msg );
+static void parsejoin( const ircmsg_t *msg );
+static void parsepart( const ircmsg_t *msg );
+static void parsemode( const ircmsg_t *msg );
+static void parsejoinerr( const ircmsg_t *msg );
+static void parsenames( const ircmsg_t *msg );
+static void parseisupport( const ircmsg_t *msg );
+static void parsenamesend( const ircmsg_t *msg );
+static void parsekick( const ircmsg_t *msg );
+static void parsenick( const ircmsg_t *msg );
+static void parsequit( const ircmsg_t *msg );
+
+/* define handlers */
+static const handler_t IRC_HANDLER[] =
+{
+   /* COMMAND, FUNCTION */
+   { HEADER_PING,    ping },
+   { RPL_WELCOME,    welcome },
+   { HEADER_PRIVMSG, parsemessage },
+   { HEADER_JOIN,    parsejoin },
+   { HEADER_PART,    parsepart },
+   { HEADER_KICK,    parsekick },
+   { HEADER_NICK,    parsenick },
+   { HEADER_QUIT,    parsequit },
+   { HEADER_MODE,    parsemode },
+   { RPL_ISUPPORT,   parseisupport },
+   { RPL_NAMREPLY,   parsenames },
+   { RPL_ENDOFNAMES, parsenamesend },
+   { ERR_NOSUCHCHANNEL,    parsejoinerr },
+   { ERR_TOOMANYCHANNELS,  parsejoinerr },
+   { ERR_CHANNELISFULL,    parsejoinerr },
+   { ERR_INVITEONLYCHAN,   parsejoinerr },
+   { ERR_BANNEDFROMCHAN,   parsejoinerr },
+   { ERR_BADCHANNELKEY,    parsejoinerr },
+};
+
+struct ircconn_t
+{
+   const netconf_t *net;
+   shard_t      *shard;
+   evloop_t     *loop;        /* the shard's */
+   int           socket;      /* -1 when not connected */
+   watch_t       watch;
+   recvbuf_t     recv;
+   sendq_t       sendq;
+   evtimer_t    *pace;        /* send queue refill */
+   evtimer_t    *ping;
+   evtimer_t    *retry;       /* reconnect backoff */
+   uint64_t      lastrecv;
+   uint8_t       state;       /* CONN_* */
+   uint32_t      retries;     /* failures since the last registration */
+   unsigned int  seed;        /* backoff jitter */
+
+   /* establishment, getaddrinfo on its own thread, then staggered connects */
+   pthread_t        resolver;
+   uint8_t          resolving;   /* resolver to join */
+   watch_t          resolved;    /* eventfd the resolver pokes */
+   int              gai;
+   struct addrinfo *addrs;       /* families interleaved */
+   struct addrinfo *nextaddr;    /* not tried yet */
+   watch_t          dial[ CONNECT_MAX ];
+   evtimer_t       *stagger, *deadline;
+   uint8_t       active;      /* had events, flushed by the shard's tick */
+   isupport_t    isupport;    /* isupport_reset() */
+   uint8_t       keymap;      /* eCASEMAP the keys below were folded with */
+   casekey_t     me;          /* our nick */
+   char          mekey[ KEY_MAX ];
+   char          menick[ KEY_MAX ]; /* as the server calls us, from 001 and NICK */
+   casekey_t     fromnick, fromchan; /* sender of the line being handled, msgtouser() */
+   char          fromnickkey[ KEY_MAX ], fromchankey[ KEY_MAX ];
+   aclent_t      acl[ LENGTH(IRC_PRIV) ]; /* acl_compile() */
+   uint32_t      aclgen;      /* bumped on reload, older usr_t caches are stale */
+
+   /* channels by name, nicks by name, members by (channel, nick id) */
+   hmap_t        chans, nicks, usrs;
+   uint32_t      nickid;
+   hmap_t        floods;      /* floodrec_t by floodid() */
+   chan_t       *joins, *parts, *modeq;
+   pool_t        chan_pool, nick_pool, usr_pool, mode_pool, ban_pool;
+   pool_t        line_pool, target_pool, job_pool, flood_pool;
+
+   job_t        *jobs, *jobs_last; /* waiting to start */
+   job_t        *jobs_running[ SH_JOBS_MAX ];
+   size_t        jobs_count;
+
+   /* journal, -1 when nothing is stored (replay) */
+   int           store;
+   size_t        store_size;
+   pid_t         store_pid;   /* compaction running */
+   watch_t       store_proc;  /* pidfd of it */
+   char          store_db[ STORE_PATH_MAX ], store_journal[ STORE_PATH_MAX ];
+   char          store_old[ STORE_PATH_MAX ], store_tmp[ STORE_PATH_MAX ];
+
+   metrics_t     metrics;
+   hist_t        hist[ STAGE_MAX ];
+   hist_t        handler_hist[ LENGTH(IRC_HANDLER) + 1 ]; /* last one for the rest */
+   capture_t    *capture;     /* replay, lines kept instead of sent */
+   arena_t       arena;       /* reset after every line */
+};
+
+/* connection lifecycle, users, bans and channels outlive each socket */
+typedef enum
+{ CONN_CONNECTING = 0, CONN_UP, CONN_WAIT, CONN_DEAD
+} eCONN;
+
+/* event loop thread and the connections it runs */
+struct shard_t
+{
+   pthread_t        thread;
+   evloop_t         loop;
+   pthread_mutex_t  lock;   /* held while handling events, metrics take it too */
+   watch_t          wake;   /* eventfd, asks the loop to stop */
+   ircconn_t      **conns;
+   size_t           nconns, live;
+   uint8_t          started;
 };
 
+static ircconn_t *IRC_CONNS[ LENGTH(IRC_NETWORKS) ];
+static shard_t *IRC_SHARDS = NULL;
+static size_t IRC_NSHARDS = 0, IRC_NDONE = 0;
+
 static void cmd_help( const user_info *user, const char *message )
 {
+   const char *vars[ VAR_MAX ] = { NULL };
    size_t i;
-   char buffer[256];
 
    i = 0;
-   say( "Commands:", user->nick );
+   uservars( vars, user );
+   say_reply( REPLY_HELP, user->nick, vars );
    for(; i != LENGTH( MSG_CMD ); ++i)
    {
-      snprintf(buffer, 256, "%s - %s", MSG_CMD[i].command, MSG_CMD[i].help);
-      say( buffer, user->nick );
+      vars[ VAR_COMMAND ] = MSG_CMD[i].command;
+      vars[ VAR_HELP ]    = MSG_CMD[i].help;
+      say_reply( REPLY_HELP_LINE, user->nick, vars );
    }
 }
 
@@ -163,63 +1031,53 @@ static void cmd_unban( const user_info *user, const char *message )
    count = strsplit(&split,message," ");
    i = 0;
    for(; i != count; ++i)
-      unban( getusr(split[i], user->channel) );
-   strsplit_clear(&split);
-   if(!count) { unban( getusr(message, user->channel) ); return; }
+      unbanarg( split[i], user->channel );
+   if(!count) { unbanarg( message, user->channel ); return; }
 }
 
 static void cmd_ban( const user_info *user, const char *message )
 {
-   char nick[ NICK_MAX ];
-   char reason[ strlen(message) ];
-   int i, p;
+   char target[ LINE_MAX ];
+   const char *reason;
+   size_t len;
 
    if(!isop(user))
       return;
 
    if(!strlen(message)) return;
 
-   memset( nick,     0, NICK_MAX * sizeof(char));
-   memset( reason,   0, strlen(message) * sizeof(char));
-
-   /* nick */
-   p = 0; i = 0;
-   for(; i != strlen(message) && !isspace(message[i]); ++i)
-      nick[p++] = message[i];
+   /* nick or mask */
+   len = strcspn( message, " \t" );
+   if(len >= LINE_MAX) return;
+   memcpy( target, message, len );
+   target[len] = '\0';
 
    /* reason */
-   p = 0; i++;
-   for(; i < strlen(message); ++i)
-      reason[p++] = message[i];
+   reason = message + len;
+   if(*reason) ++reason;
 
-   ban( getusr(nick, user->channel), reason );
+   if(strchr(target, '!') || strchr(target, '@'))
+      banmask( target, user->channel, reason );
+   else ban( getusr(target, user->channel), reason );
 }
 
 static void cmd_kick( const user_info *user, const char *message )
 {
-   char nick[ NICK_MAX ];
-   char reason[ strlen(message) ];
-   int i, p;
+   char nick[ LINE_MAX ];
+   size_t len;
 
    if(!isop(user))
       return;
 
    if(!strlen(message)) return;
 
-   memset( nick,     0, NICK_MAX * sizeof(char));
-   memset( reason,   0, strlen(message) * sizeof(char));
-
-   /* nick */
-   p = 0; i = 0;
-   for(; i != strlen(message) && !isspace(message[i]); ++i)
-      nick[p++] = message[i];
-
-   /* reason */
-   p = 0; i++;
-   for(; i < strlen(message); ++i)
-      reason[p++] = message[i];
+   /* nick, the rest is the reason */
+   len = strcspn( message, " \t" );
+   if(len >= LINE_MAX) return;
+   memcpy( nick, message, len );
+   nick[len] = '\0';
 
-   kick( getusr(nick, user->channel), reason );
+   kick( getusr(nick, user->channel), message[len] ? message + len + 1 : "" );
 }
 
 static void cmd_op( const user_info *user, const char *message )
@@ -236,7 +1094,6 @@ static void cmd_op( const user_info *user, const char *message )
    i = 0;
    for(; i != count; ++i)
       set_mode( getusr(split[i], user->channel), "+o" );
-   strsplit_clear(&split);
    if(!count) { set_mode( getusr(message, user->channel), "+o" ); return; }
 }
 
@@ -254,7 +1111,6 @@ static void cmd_deop( const user_info *user, const char *message )
    i = 0;
    for(; i != count; ++i)
       set_mode( getusr(split[i], user->channel), "-o" );
-   strsplit_clear(&split);
    if(!count) { set_mode( getusr(message, user->channel), "-o" ); return; }
 }
 
@@ -266,691 +1122,4487 @@ static void cmd_topic( const user_info *user, const char *message )
    set_topic( user->channel, message );
 }
 
+static void cmd_join( const user_info *user, const char *message )
+{
+   char **split = NULL;
+   int count = 0, i;
+
+   if(!isop(user))
+      return;
+
+   if(!strlen(message)) return;
+
+   count = strsplit(&split,message," ");
+   i = 0;
+   for(; i != count; ++i)
+      joinchannel( split[i] );
+}
+
+static void cmd_part( const user_info *user, const char *message )
+{
+   char **split = NULL;
+   int count = 0, i;
+
+   if(!isop(user))
+      return;
+
+   if(!strlen(message)) { partchannel( user->channel ); return; }
+
+   count = strsplit(&split,message," ");
+   i = 0;
+   for(; i != count; ++i)
+      partchannel( split[i] );
+}
+
 static void cmd_test( const user_info *user, const char *message )
 {
-   say_highlight( "Hello World!", user );
+   const char *vars[ VAR_MAX ] = { NULL };
+
+   uservars( vars, user );
+   say_reply( REPLY_TEST, user->channel, vars );
+}
+
+static void cmd_uptime( const user_info *user, const char *message )
+{
+   if(!isop(user))
+      return;
+
+   sh_run( SH_UPTIME, user, sh_reply );
 }
 
 /* JOIN SIGNAL */
 static void JOIN( const user_info *user )
 {
-   if(!hasban(user)) say_highlight( "Welcome!", user );
+   const char *vars[ VAR_MAX ] = { NULL };
+   chan_t *c = userchan( user );
+   if(!c || !(c->flags & CHAN_WELCOME)) return;
+   if(hasban(user)) return;
+   uservars( vars, user );
+   say_reply( REPLY_WELCOME, user->channel, vars );
 }
 
 /* PART SIGNAL */
 static void PART( const user_info *user )
 {
-   say_highlight( "Goodbye!", user );
+   const char *vars[ VAR_MAX ] = { NULL };
+   chan_t *c = userchan( user );
+   if(!c || !(c->flags & CHAN_WELCOME)) return;
+   uservars( vars, user );
+   say_reply( REPLY_GOODBYE, user->channel, vars );
 }
 
 /* HELPER FUNCTIONS */
-static int isop( const user_info *user )
+static int ischannel( const char *name )
 {
-   size_t i;
+   return( *name && strchr(IRC_CONN->isupport.chantypes, *name) != NULL );
+}
+
+/* bytes userpack needs */
+static size_t userlen( const user_info *user )
+{
+   return( strlen(user->nick) + strlen(user->ident) + strlen(user->host) + strlen(user->channel) + 4 );
+}
+
+/* deep copy, the strings of dst end up in buf */
+static int userpack( user_info *dst, char *buf, size_t size, const user_info *src )
+{
+   const char *from[4] = { src->nick, src->ident, src->host, src->channel };
+   const char **to[4]  = { &dst->nick, &dst->ident, &dst->host, &dst->channel };
+   size_t i, len;
+
+   if(userlen( src ) > size) return( RETURN_FAIL );
 
+   dst->privs = src->privs;
+   dst->nkey  = dst->ckey = NULL; /* they point at the line being handled */
    i = 0;
-   for(; i != LENGTH(IRC_PRIV); ++i)
+   for(; i != 4; ++i)
    {
-      if(IRC_PRIV[i].ident)
-      {
-         if(!strcmp(user->nick, IRC_PRIV[i].nick) &&
-            !strstr(user->ident, IRC_PRIV[i].ident))
-         {
-            if(strstr(IRC_PRIV[i].priv, "o")) return 1;
-         }
-      } else
-      {
-         if(!strcmp(user->nick, IRC_PRIV[i].nick))
-         {
-            if(strstr(IRC_PRIV[i].priv, "o")) return 1;
-         }
-      }
+      len = strlen(from[i]) + 1;
+      memmove( buf, from[i], len );
+      *to[i] = buf;
+      buf += len;
    }
+   return( RETURN_OK );
+}
 
+/* does mode take a parameter, from PREFIX and CHANMODES */
+static int modeparam( char mode, int set )
+{
+   if(strchr(IRC_CONN->isupport.prefixmodes, mode)) return 1;
+   if(strchr(IRC_CONN->isupport.chanmodes[0], mode)) return 1; /* list */
+   if(strchr(IRC_CONN->isupport.chanmodes[1], mode)) return 1; /* always */
+   if(strchr(IRC_CONN->isupport.chanmodes[2], mode)) return set; /* only when set */
    return 0;
 }
 
-static uint8_t SAY_COUNT = 0;
+/* privs were resolved with the sender, see useracl() */
+static int isop( const user_info *user )
+{
+   return( (user->privs & USR_OP) != 0 );
+}
+
 static void say( const char *message, const char *target )
 {
-   char buffer[ BUFFER_SIZE ];
+   sendq_printf( &IRC_CONN->sendq, PRIO_BULK, target, "PRIVMSG %s :%s", target, message );
+}
+
+/* template placeholders a user fills */
+static void uservars( const char **vars, const user_info *user )
+{
+   vars[ VAR_NICK ]    = user->nick;
+   vars[ VAR_IDENT ]   = user->ident;
+   vars[ VAR_HOST ]    = user->host;
+   vars[ VAR_CHANNEL ] = user->channel;
+}
 
-   snprintf(buffer, BUFFER_SIZE,"PRIVMSG %s :%s\r\n", target, message);
-#if DEBUG
-   printf("$ %s\n", buffer);
-#endif
-   send(IRC_SOCKET, buffer, strlen(buffer) * sizeof(char), 0);
+/* printf style head, then the template expanded straight into the line */
+static void reply( uint8_t prio, const char *target, uint8_t id, const char **vars, const char *fmt, ... )
+{
+   va_list args;
+   sendline_t *l;
+   size_t n;
+   int len;
+
+   if(!(l = pool_alloc( &IRC_CONN->line_pool ))) return;
+
+   va_start( args, fmt );
+   len = vsnprintf( l->line, LINE_MAX - 1, fmt, args );
+   va_end( args );
+   if(len < 0 || len > LINE_MAX - 2) { pool_free( &IRC_CONN->line_pool, l ); return; }
 
-   if(++SAY_COUNT==5)
-   { SAY_COUNT = 0; usleep( 500 * 1000 ); /* lol flood avoid, should be replaced with queue */ }
+   n = tmpl_expand( l->line + len, LINE_MAX - 2 - len, &IRC_TMPL[id], vars );
+   if(!n && len >= 2 && l->line[len - 2] == ' ' && l->line[len - 1] == ':') len -= 2; /* no trailing */
+   sendq_push( &IRC_CONN->sendq, prio, target, l, len + n );
 }
 
-static void say_highlight( const char *message, const user_info *user )
+static void say_reply( uint8_t id, const char *target, const char **vars )
 {
-   char buffer[ MESSAGE_MAX ];
+   reply( PRIO_BULK, target, id, vars, "PRIVMSG %s :", target );
+}
+
+static void kick_reply( const user_info *user, uint8_t id, const char *reason )
+{
+   const char *vars[ VAR_MAX ] = { NULL };
+   chan_t *c;
+
    if(!user) return;
+   if((c = userchan( user )) && c->modes) chanmodeflush( c ); /* keep the order */
 
-   snprintf( buffer, MESSAGE_MAX, "%s: %s", user->nick, message );
-   say( buffer, user->channel );
+   uservars( vars, user );
+   vars[ VAR_REASON ] = reason;
+   reply( PRIO_MODERATION, NULL, id, vars, "KICK %s %s :", user->channel, user->nick );
 }
 
 static void kick( const user_info *user, const char *reason )
 {
-   char buffer[ BUFFER_SIZE ];
-   if(!user) return;
-
-   if(reason && strlen(reason))
-        snprintf(buffer, BUFFER_SIZE,"KICK %s %s :%s\r\n", user->channel, user->nick, reason);
-   else snprintf(buffer, BUFFER_SIZE,"KICK %s %s\r\n", user->channel, user->nick);
-#if DEBUG
-   printf("$ %s\n", buffer);
-#endif
-   send(IRC_SOCKET, buffer, strlen(buffer) * sizeof(char), 0);
+   kick_reply( user, REPLY_KICK, reason );
 }
 
 static void set_channel_mode( const char *channel, const char *level )
 {
-   char buffer[ BUFFER_SIZE ];
+   sendq_printf( &IRC_CONN->sendq, PRIO_MODERATION, NULL, "MODE %s %s", channel, level );
+}
 
-   snprintf(buffer, BUFFER_SIZE,"MODE %s %s\r\n", channel, level);
-#if DEBUG
-   printf("$ %s\n", buffer);
-#endif
-   send(IRC_SOCKET, buffer, strlen(buffer) * sizeof(char), 0);
+/* queue a user mode, a later opposite change for the same nick wins */
+static void modequeue( chan_t *c, char sign, char mode, const char *nick, const casekey_t *k )
+{
+   char buf[ KEY_MAX ];
+   casekey_t mk;
+   pendmode_t *m;
+
+   /* +o Bob then -o bob is the same nick */
+   for(m = c->modes; m; m = m->next)
+   {
+      if(m->mode != mode || m->hash != k->hash) continue;
+      casekey( &mk, buf, sizeof(buf), m->nick );
+      if(keyeq( &mk, k )) { m->sign = sign; return; }
+   }
+
+   if(strlen(nick) >= IRC_CONN->mode_pool.size - sizeof(pendmode_t)) return;
+   if(!(m = pool_alloc( &IRC_CONN->mode_pool ))) return;
+   m->next = NULL;
+   m->hash = k->hash;
+   m->sign = sign;
+   m->mode = mode;
+   strcpy( m->nick, nick );
+   if(c->modes_tail) c->modes_tail->next = m;
+   else c->modes = m;
+   c->modes_tail = m;
+
+   if(c->mqueued) return;
+   c->mqueued = 1;
+   c->mbatch  = IRC_CONN->modeq;
+   IRC_CONN->modeq  = c;
 }
 
+/* level is "+o", "-v", "+ov", ... sent with the next flush */
 static void set_mode( const user_info *user, const char *level )
 {
-   char buffer[ BUFFER_SIZE ];
+   char buf[ KEY_MAX ];
+   casekey_t k;
+   const casekey_t *nk;
+   chan_t *c;
+   char sign = '+';
+
    if(!user) return;
+   if(!(c = userchan( user )))
+   {
+      sendq_printf( &IRC_CONN->sendq, PRIO_MODERATION, NULL, "MODE %s %s %s", user->channel, level, user->nick );
+      return;
+   }
 
-   snprintf(buffer, BUFFER_SIZE,"MODE %s %s %s\r\n", user->channel, level, user->nick);
-#if DEBUG
-   printf("$ %s\n", buffer);
-#endif
-   send(IRC_SOCKET, buffer, strlen(buffer) * sizeof(char), 0);
+   nk = nickkey( user, &k, buf );
+   for(; *level; ++level)
+   {
+      if(*level == '+' || *level == '-') sign = *level;
+      else modequeue( c, sign, *level, user->nick, nk );
+   }
 }
 
-static void set_topic( const char *channel, const char *topic )
+static void modeclear( chan_t *c )
+{
+   pendmode_t *m, *next;
+
+   for(m = c->modes; m; m = next)
+   { next = m->next; pool_free( &IRC_CONN->mode_pool, m ); }
+   c->modes = c->modes_tail = NULL;
+}
+
+/* MODE #chan +oo-v a b c, the ISUPPORT MODES count per line */
+static void chanmodeflush( chan_t *c )
+{
+   char modes[ LINE_MAX ], args[ LINE_MAX ];
+   size_t n, mlen, alen, nlen, room;
+   pendmode_t *m;
+   char sign;
+
+   room = LINE_MAX - 2 - strlen("MODE  ") - strlen(c->name) - 1;
+   n = mlen = alen = 0;
+   sign = 0;
+   for(m = c->modes; m; m = m->next)
+   {
+      nlen = strlen(m->nick);
+      if(n && (n == IRC_CONN->isupport.modes || mlen + 2 + alen + 1 + nlen > room))
+      {
+         sendq_printf( &IRC_CONN->sendq, PRIO_MODERATION, NULL, "MODE %s %.*s %.*s", c->name, (int)mlen, modes, (int)alen, args );
+         n = mlen = alen = 0;
+         sign = 0;
+      }
+      if(m->sign != sign) modes[mlen++] = sign = m->sign;
+      modes[mlen++] = m->mode;
+      if(alen) args[alen++] = ' ';
+      memcpy( args + alen, m->nick, nlen );
+      alen += nlen;
+      n++;
+   }
+   if(n) sendq_printf( &IRC_CONN->sendq, PRIO_MODERATION, NULL, "MODE %s %.*s %.*s", c->name, (int)mlen, modes, (int)alen, args );
+   modeclear( c );
+}
+
+static void modeflush(void)
 {
-   char buffer[ BUFFER_SIZE ];
+   chan_t *c;
+
+   while((c = IRC_CONN->modeq))
+   {
+      IRC_CONN->modeq  = c->mbatch;
+      c->mbatch  = NULL;
+      c->mqueued = 0;
+      chanmodeflush( c );
+   }
+}
 
+static void set_topic( const char *channel, const char *topic )
+{
    if(!topic) return;
    if(!strlen(topic)) return;
 
-   snprintf(buffer, BUFFER_SIZE,"TOPIC %s :%s\r\n", channel, topic);
-#if DEBUG
-   printf("$ %s\n", buffer);
-#endif
-   send(IRC_SOCKET, buffer, strlen(buffer) * sizeof(char), 0);
+   sendq_printf( &IRC_CONN->sendq, PRIO_MODERATION, NULL, "TOPIC %s :%s", channel, topic );
 }
 
-static size_t sh_run( const char *cmd, char output[][SH_READ_MAX], size_t lines )
+static void sh_start( job_t *job );
+
+/* both the pipe and the child are done with */
+static void sh_finish( job_t *job )
 {
-   size_t nbytes, i;
-   FILE *pipe;
+   job_t *next;
+
+   evloop_cancel( IRC_CONN->loop, job->timeout );
+   job->timeout = NULL;
+   hist_add( &IRC_CONN->metrics.job_time, now_ns() - job->started );
 
 #if DEBUG
-   printf("$ %s\n", cmd);
+   printf("$ JOB %d exited %d%s\n", (int)job->pid, job->status, job->killed ? " (killed)" : "");
 #endif
 
-   pipe = popen(cmd, "r");
-   if (!pipe) return( 0 );
+   if(job->done) job->done( job );
+   IRC_CONN->jobs_running[ job->slot ] = IRC_CONN->jobs_running[ --IRC_CONN->jobs_count ];
+   IRC_CONN->jobs_running[ job->slot ]->slot = job->slot;
+   pool_free( &IRC_CONN->job_pool, job );
 
-   i = 0;
-   while(fgets(output[i], SH_READ_MAX, pipe) != NULL)
-   { if(lines && i == lines) break; i++; }
+   /* a slot opened up */
+   if((next = IRC_CONN->jobs))
+   {
+      if(!(IRC_CONN->jobs = next->next)) IRC_CONN->jobs_last = NULL;
+      sh_start( next );
+   }
+}
+
+static void sh_read( watch_t *w, uint32_t events )
+{
+   job_t *job = w->data;
+   char discard[ BUFFER_SIZE ];
+   ssize_t bytes;
+
+   (void)events;
+   connenter( job->conn );
+   if(job->len < SH_OUTPUT_MAX)
+        bytes = read(w->fd, job->output + job->len, SH_OUTPUT_MAX - job->len);
+   else bytes = read(w->fd, discard, sizeof(discard));
+
+   if(bytes < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+   if(bytes > 0)
+   {
+      if(job->len < SH_OUTPUT_MAX) job->len += bytes;
+      else job->truncated = 1; /* keep draining so the child never blocks */
+      return;
+   }
 
-   pclose(pipe);
-   return( i );
+   evloop_unwatch( IRC_CONN->loop, w );
+   close(w->fd);
+   job->eof = 1;
+   if(job->exited) sh_finish( job );
 }
 
-static void clearbans(void)
+static void sh_exit( watch_t *w, uint32_t events )
 {
-   ban_t *c = IRC_BAN, *next = NULL;
+   job_t *job = w->data;
 
-   for(; c; c = next)
-   { next = c->next; free(c); }
-   IRC_BAN = NULL;
+   (void)events;
+   connenter( job->conn );
+   if(waitpid( job->pid, &job->status, WNOHANG ) == 0) return;
+
+   evloop_unwatch( IRC_CONN->loop, w );
+   close(w->fd);
+   job->exited = 1;
+   if(job->eof) sh_finish( job );
 }
 
-static void delban(ban_t *b )
+static void sh_timeout( void *data )
 {
-   ban_t *c = IRC_BAN, **cc = &IRC_BAN;
+   job_t *job = data;
 
-   if(!b) return;
+   connenter( job->conn );
+   job->timeout = NULL;
+   job->killed  = 1;
+   IRC_CONN->metrics.jobs_killed++;
+   kill( -job->pid, SIGKILL );
+}
 
-   for(; c && c->next && c->next != b; c = c->next)
-      cc = &c;
-   (*cc)->next = b->next;
+static void sh_start( job_t *job )
+{
+   sigset_t none;
+   int fds[2], devnull;
 
 #if DEBUG
-   printf( "$ DELBAN %s!%s %s\n", b->user->nick, b->user->ident, b->user->channel );
+   printf("$ %s\n", job->cmd);
 #endif
 
-   if(b == IRC_BAN) IRC_BAN = NULL;
-   free(b->user);
-   free(b);
+   job->slot = IRC_CONN->jobs_count;
+   IRC_CONN->jobs_running[ IRC_CONN->jobs_count++ ] = job;
+   job->started = now_ns();
+   IRC_CONN->metrics.jobs_started++;
+   job->out.fd = job->proc.fd = -1;
+   if(pipe2( fds, O_CLOEXEC ) == -1) goto fail;
+   fcntl( fds[0], F_SETFL, O_NONBLOCK ); /* the child writes blocking */
+
+   if((job->pid = fork()) == -1) { close(fds[0]); close(fds[1]); goto fail; }
+   if(!job->pid)
+   {
+      /* child, undo what the bot blocked for its signalfd */
+      sigemptyset( &none );
+      sigprocmask( SIG_SETMASK, &none, NULL );
+      setpgid( 0, 0 ); /* so a timeout takes down the whole pipeline */
+      if((devnull = open("/dev/null", O_RDONLY)) != -1) dup2( devnull, STDIN_FILENO );
+      dup2( fds[1], STDOUT_FILENO );
+      execl( "/bin/sh", "sh", "-c", job->cmd, (char*)NULL );
+      _exit( 127 );
+   }
+   close(fds[1]);
+   setpgid( job->pid, job->pid );
+
+   job->out.fd        = fds[0];
+   job->out.function  = sh_read;
+   job->out.data      = job;
+   job->proc.fd       = syscall( SYS_pidfd_open, job->pid, 0 );
+   job->proc.function = sh_exit;
+   job->proc.data     = job;
+   if(job->proc.fd == -1 ||
+      evloop_watch( IRC_CONN->loop, &job->out,  EPOLLIN ) != RETURN_OK ||
+      evloop_watch( IRC_CONN->loop, &job->proc, EPOLLIN ) != RETURN_OK)
+   {
+      kill( job->pid, SIGKILL );
+      waitpid( job->pid, NULL, 0 );
+      evloop_unwatch( IRC_CONN->loop, &job->out );
+      close(job->out.fd);
+      if(job->proc.fd != -1) close(job->proc.fd);
+      goto fail;
+   }
+
+   job->timeout = evloop_timer( IRC_CONN->loop, SH_TIMEOUT, sh_timeout, job );
+   return;
+
+fail:
+   IRC_CONN->metrics.jobs_failed++;
+   job->status = -1;
+   job->eof = job->exited = 1;
+   sh_finish( job );
 }
 
-static int hasban( const user_info *user )
+/* Runs cmd through /bin/sh without waiting for it. done gets called
+ * from the event loop with the collected output once the child exits,
+ * sh_reply says it back to the user. */
+static int sh_run( const char *cmd, const user_info *user, job_func *done )
+{
+   job_t *job;
+
+   if(strlen(cmd) >= SH_CMD_MAX) return( RETURN_FAIL );
+   if(!(job = pool_alloc( &IRC_CONN->job_pool ))) return( RETURN_FAIL );
+
+   memset( job, 0, sizeof(job_t) );
+   strcpy( job->cmd, cmd );
+   if(!user || userpack( &job->user, job->who, LINE_MAX, user ) != RETURN_OK)
+      job->user.nick = job->user.ident = job->user.host = job->user.channel = "";
+   job->done = done;
+   job->conn = IRC_CONN;
+
+   if(IRC_CONN->jobs_count < SH_JOBS_MAX) { sh_start( job ); return( RETURN_OK ); }
+
+   if(IRC_CONN->jobs_last) IRC_CONN->jobs_last->next = job;
+   else IRC_CONN->jobs = job;
+   IRC_CONN->jobs_last = job;
+   return( RETURN_OK );
+}
+
+static void sh_reply( job_t *job )
+{
+   const char *vars[ VAR_MAX ] = { NULL };
+   char *line, *eol, *end;
+   size_t lines;
+
+   if(!job->user.nick[0]) return;
+   uservars( vars, &job->user );
+   if(job->killed) { say_reply( REPLY_TIMEOUT, job->user.channel, vars ); return; }
+
+   line = job->output;
+   end  = job->output + job->len;
+   lines = 0;
+   for(; line < end && lines != SH_LINES_MAX; line = eol + 1, ++lines)
+   {
+      if(!(eol = memchr(line, '\n', end - line))) eol = end;
+      *eol = '\0';
+      say( line, job->user.channel );
+   }
+   if(line < end || job->truncated) say_reply( REPLY_TRUNCATED, job->user.channel, vars );
+}
+
+static int dropchan( void *value, const void *ctx )
 {
-   ban_t *c = IRC_BAN;
+   chan_t *c = value;
 
-   for(; c; c = c->next)
-      if( !strcmp(c->user->nick,  user->nick)  ||
-          !strcmp(c->user->ident, user->ident) )
-         return 1;
+   (void)ctx;
+   banlist_clear( &c->bans );
+   dropnames( c );
+   xfree(c->name);
+   pool_free( &IRC_CONN->chan_pool, c );
    return 0;
 }
 
-static void unban( const user_info *user )
+static void clearbans(void)
 {
-   char message[ BUFFER_SIZE ];
-   ban_t *c = IRC_BAN;
+   hmap_sweep( &IRC_CONN->chans, dropchan, NULL );
+   hmap_clear( &IRC_CONN->chans );
+   pool_clear( &IRC_CONN->chan_pool );
+   pool_clear( &IRC_CONN->ban_pool );
+   IRC_CONN->joins = IRC_CONN->parts = IRC_CONN->modeq = NULL;
+   pool_clear( &IRC_CONN->mode_pool );
+}
 
-   if(!user) return;
+/* bans are per channel, private messages have none */
+static banlist_t* getbans( const char *channel )
+{
+   chan_t *c = getchan( channel );
+   return( c ? &c->bans : NULL );
+}
 
-   for(; c; c = c->next)
-      if( !strcmp(c->user->nick,  user->nick)  ||
-          !strcmp(c->user->ident, user->ident) )
-      {
-         delban(c);
-         snprintf( message, BUFFER_SIZE, "* Unbanned %s", user->nick);
-         say( message, user->channel ); return;
-      }
+static int hasban( const user_info *user )
+{
+   chan_t *c = userchan( user );
+   return( c && banlist_find( &c->bans, user ) != NULL );
+}
+
+static void unban( const user_info *victim )
+{
+   const char *vars[ VAR_MAX ] = { NULL };
+   char store[ LINE_MAX ];
+   user_info user;
+   banlist_t *bans;
+   ban_t *b;
+   uint8_t found = 0;
+
+   if(!victim) return;
+   if(!(bans = getbans( victim->channel ))) return;
+   if(userpack( &user, store, LINE_MAX, victim ) != RETURN_OK) return; /* might live in the ban */
+
+   while((b = banlist_victim( bans, user.nick )) ||
+         (b = banlist_find( bans, &user )))
+   { store_unban( user.channel, b ); banlist_del( bans, b ); found = 1; }
+
+   if(!found) return;
+   uservars( vars, &user );
+   vars[ VAR_TARGET ] = user.nick;
+   say_reply( REPLY_UNBANNED, user.channel, vars );
+}
+
+/* !unban takes nicks and masks */
+static void unbanarg( const char *arg, const char *channel )
+{
+   const char *vars[ VAR_MAX ] = { NULL };
+   banlist_t *bans;
+   ban_t *b;
+
+   if(!strchr(arg, '!') && !strchr(arg, '@'))
+   { unban( getusr(arg, channel) ); return; }
+
+   if(!(bans = getbans( channel ))) return;
+   if(!(b = banlist_mask( bans, arg ))) return;
+   store_unban( channel, b );
+   banlist_del( bans, b );
+   vars[ VAR_CHANNEL ] = channel;
+   vars[ VAR_TARGET ]  = arg;
+   say_reply( REPLY_UNBANNED, channel, vars );
 }
 
 static void ban( const user_info *user, const char *reason )
 {
-   ban_t *c;
+   char mask[ LINE_MAX ];
+   banlist_t *bans;
+   chan_t *c;
+   ban_t *b;
 
    if(!user) return;
-   if(hasban(user)) return;
+   if(!(c = userchan( user ))) return;
+   bans = &c->bans;
+   if(banlist_find( bans, user )) return;
+
+   /* loaded from NAMES without a host, *!@ would hit everyone */
+   if(user->host[0]) snprintf( mask, LINE_MAX, "*!%s@%s", user->ident, user->host );
+   else snprintf( mask, LINE_MAX, "%s!*@*", user->nick );
+   if(!(b = banlist_add( bans, mask, user, reason )))
+      return;
+   store_ban( user->channel, b );
 
-   if(!IRC_BAN) { IRC_BAN = malloc( sizeof(ban_t) ); c = IRC_BAN; }
-   else {
-      c = IRC_BAN; for(; c && c->next; c = c->next);
-      c->next = malloc( sizeof(ban_t) ); c = c->next;
-   }
-   if(!c) return;
+#if DEBUG
+   printf( "$ BANUSR %s!%s@%s %s\n", user->nick, user->ident, user->host, user->channel );
+#endif
+
+   /* finally kick */
+   kick( &b->user, b->reason );
+}
+
+/* ban a mask and kick whoever on the channel it hits */
+static void banmask( const char *mask, const char *channel, const char *reason )
+{
+   chan_t *c;
+   ban_t *b;
+   usr_t *u;
 
-   c->user = malloc( sizeof(user_info) );
-   if(!c->user)   { delban(c); return; }
-   memcpy( c->user, user, sizeof(user_info) );
-   c->reason = strdup(reason);
-   if(!c->reason) { delban(c); return; }
-   c->next = NULL;
+   if(!(c = getchan( channel ))) return;
+   if(banlist_mask( &c->bans, mask )) return;
+   if(!(b = banlist_add( &c->bans, mask, NULL, reason )))
+      return;
+   store_ban( channel, b );
 
 #if DEBUG
-   printf( "$ BANUSR %s!%s %s\n", user->nick, user->ident, user->channel );
+   printf( "$ BANMASK %s %s\n", b->text, channel );
 #endif
 
-   /* finally kick */
-   kick( c->user, c->reason );
+   for(u = c->members; u; u = u->next)
+      if(banlist_find( &c->bans, &u->user ) == b)
+         kick( &u->user, b->reason );
+}
+
+static int dropbig( void *value, const void *ctx )
+{
+   (void)ctx;
+   xfree(((nick_t*)value)->big);
+   return 0;
 }
 
 static void clearusrs(void)
 {
-   usr_t *c = IRC_USR, *next = NULL;
+   hmap_sweep( &IRC_CONN->nicks, dropbig, NULL );
+   hmap_clear( &IRC_CONN->usrs );
+   hmap_clear( &IRC_CONN->nicks );
+   pool_clear( &IRC_CONN->usr_pool );
+   pool_clear( &IRC_CONN->nick_pool );
+}
+
+#define HASH_SEED 2166136261u
+/* by nick id, a NICK leaves the memberships where they are */
+static uint32_t usrhash( const chan_t *c, const nick_t *n )
+{
+   return( (c->key.hash * 16777619u) ^ (n->id * 2654435761u) );
+}
+
+static int usrcmp( const void *value, const void *key )
+{
+   const usr_t    *u = value;
+   const usrkey_t *k = key;
+   return( u->chan == k->chan && u->nick == k->nick );
+}
+
+static int nickcmp( const void *value, const void *key )
+{
+   return keyeq( &((const nick_t*)value)->key, key );
+}
+
+static nick_t* nickfind( const casekey_t *nick )
+{
+   return hmap_get( &IRC_CONN->nicks, nick->hash, nickcmp, nick );
+}
+
+static usr_t* usrget( const chan_t *c, const nick_t *n )
+{
+   usrkey_t key = { c, n };
+   return hmap_get( &IRC_CONN->usrs, usrhash(c, n), usrcmp, &key );
+}
 
-   for(; c; c = next)
-   { next = c->next; free(c); }
-   IRC_USR = NULL;
+/* every registry lookup goes through here, for the metrics */
+static usr_t* usrfind( const chan_t *c, const casekey_t *nick )
+{
+   uint64_t start = 0;
+   usr_t *u = NULL;
+   nick_t *n;
+
+   if(IRC_STATS) start = now_ns();
+   if((n = nickfind( nick ))) u = usrget( c, n );
+   if(!IRC_STATS) return u;
+   hist_add( &IRC_CONN->metrics.usr_lookup, now_ns() - start );
+   if(u) IRC_CONN->metrics.usr_hits++;
+   else IRC_CONN->metrics.usr_misses++;
+   return u;
 }
 
 static user_info* getusr( const char *nick, const char *channel )
 {
-   usr_t *c = IRC_USR;
-   ban_t *b = IRC_BAN;
+   char buf[ KEY_MAX ];
+   casekey_t k;
+   chan_t *c;
+   usr_t *u;
+   ban_t *b;
 
-   for(; c; c = c->next)
-      if( !strcmp(c->user->nick,    nick)  &&
-          !strcmp(c->user->channel, channel))
-         return c->user;
+   if(!(c = getchan( channel ))) return NULL;
+   casekey( &k, buf, sizeof(buf), nick );
+   if((u = usrfind( c, &k )))
+      return &u->user;
 
    /* might be banned too */
-   for(; b; b = b->next)
-      if( !strcmp(b->user->nick,    nick)  &&
-          !strcmp(b->user->channel, channel))
-         return b->user;
+   if((b = banlist_victim( &c->bans, nick )))
+      return &b->user;
 
    return NULL;
 }
 
-static int hasusr( const user_info *user )
+static usr_t* findusr( const user_info *user )
 {
-   usr_t *c = IRC_USR;
+   char buf[ KEY_MAX ];
+   casekey_t k;
+   chan_t *c;
 
-   for(; c; c = c->next)
-      if( !strcmp(c->user->nick,  user->nick)  &&
-          !strcmp(c->user->ident, user->ident) &&
-          !strcmp(c->user->channel, user->channel))
-         return 1;
-   return 0;
+   if(!(c = chanfind( chankey( user, &k, buf ) ))) return NULL;
+   return usrfind( c, nickkey( user, &k, buf ) );
 }
 
-static void delusr(usr_t *b)
+static void delnick( nick_t *n )
 {
-   usr_t *c = IRC_USR, **cc = &IRC_USR;
+   hmap_del( &IRC_CONN->nicks, n->key.hash, nickcmp, &n->key );
+   xfree(n->big);
+   pool_free( &IRC_CONN->nick_pool, n );
+}
 
-   if(!b) return;
+/* out of the channel and nick lists, the maps are the caller's */
+static void unlinkusr( usr_t *u )
+{
+   if(u->prev) u->prev->next = u->next;
+   else u->chan->members = u->next;
+   if(u->next) u->next->prev = u->prev;
+   u->chan->nmembers--;
+
+   if(u->cprev) u->cprev->cnext = u->cnext;
+   else u->nick->chans = u->cnext;
+   if(u->cnext) u->cnext->cprev = u->cprev;
+   u->nick->nchans--;
+   pool_free( &IRC_CONN->usr_pool, u );
+}
 
-   for(; c && c->next && c->next != b; c = c->next)
-      cc = &c;
-   (*cc)->next = b->next;
+/* the nick goes along with its last channel */
+static void delusr( usr_t *u )
+{
+   usrkey_t key = { u->chan, u->nick };
+   nick_t *n = u->nick;
 
 #if DEBUG
-   printf( "$ DELUSR %s!%s %s\n", b->user->nick, b->user->ident, b->user->channel );
+   printf( "$ DELUSR %s!%s %s\n", u->user.nick, u->user.ident, u->user.channel );
 #endif
+   hmap_del( &IRC_CONN->usrs, usrhash(u->chan, n), usrcmp, &key );
+   unlinkusr( u );
+   if(!n->nchans) delnick( n );
+}
+
+/* QUIT, O(channels of the nick) */
+static void dropnick( nick_t *n )
+{
+   usr_t *u, *next;
 
-   if(b == IRC_USR) IRC_USR = NULL;
-   free(b->user);
-   free(b);
+   for(u = n->chans; u; u = next)
+   { next = u->cnext; delusr( u ); }
 }
 
+/* walks the channel's own members, not the whole registry */
 static void unusr_channel( const char *channel )
 {
-   usr_t *c = IRC_USR;
+   chan_t *c;
 
-   for(; c; c = c->next)
-      if( !strcmp(c->user->channel, channel))
-      { delusr(c); }
+   if(!(c = getchan( channel ))) return;
+   while(c->members) delusr( c->members );
 }
 
 static void unusr( const user_info *user )
 {
-   usr_t *c = IRC_USR;
+   usr_t *u;
 
-   for(; c; c = c->next)
-      if( !strcmp(c->user->nick,  user->nick)  &&
-          !strcmp(c->user->ident, user->ident) &&
-          !strcmp(c->user->channel, user->channel))
-      { delusr(c); return; }
+   if((u = findusr( user ))) delusr( u );
 }
 
-static void addusr( const user_info *user )
+/* Pack the identity into the record. The pool is sized from ISUPPORT
+ * and can not grow while records are out, so a server announcing longer
+ * names gets those on the heap. The memberships point at the strings. */
+static int nickpack( nick_t *n, const char *nick, const char *ident, const char *host )
 {
-   usr_t *c;
-
-   if(hasban(user)) kick( user, "You are banned" );
-   if(hasusr(user)) return;
+   size_t nlen = strlen(nick), ilen = strlen(ident), hlen = strlen(host);
+   size_t need = nlen * 2 + ilen + hlen + 4;
+   char tmp[ LINE_MAX * 2 ], *p = tmp, *dst = n->data; /* the old strings may be the source */
+   usr_t *u;
 
-   if(!IRC_USR) { IRC_USR = malloc( sizeof(usr_t) ); c = IRC_USR; }
-   else {
-      c = IRC_USR; for(; c && c->next; c = c->next);
-      c->next = malloc( sizeof(usr_t) ); c = c->next;
-   }
-   if(!c) return;
+   if(nlen + ilen + hlen + 3 > sizeof(tmp)) return( RETURN_FAIL );
+   if(need > IRC_CONN->nick_pool.size - sizeof(nick_t) && !(dst = xmalloc( need )))
+      return( RETURN_FAIL );
 
-   c->user = malloc( sizeof(user_info) );
-   if(!c->user)   { delusr(c); return; }
-   memcpy( c->user, user, sizeof(user_info) );
-   c->next = NULL;
+   memcpy( p, nick, nlen + 1 );  p += nlen + 1;
+   memcpy( p, ident, ilen + 1 ); p += ilen + 1;
+   memcpy( p, host, hlen + 1 );  p += hlen + 1;
+   memcpy( dst, tmp, p - tmp );
+   if(n->big) xfree(n->big);
+   n->big = (dst != n->data) ? dst : NULL;
+
+   p = dst;
+   n->nick  = p; p += nlen + 1;
+   n->ident = p; p += ilen + 1;
+   n->host  = p; p += hlen + 1;
+   casekey( &n->key, p, nlen + 1, n->nick );
+   n->aclgen = 0; /* privileges resolved again on next use */
+
+   for(u = n->chans; u; u = u->cnext)
+   { u->user.nick = n->nick; u->user.ident = n->ident; u->user.host = n->host; }
+   return( RETURN_OK );
+}
 
-#if DEBUG
-   printf( "$ ADDUSR %s!%s %s\n", user->nick, user->ident, user->channel );
-#endif
+static nick_t* newnick( const char *nick, const char *ident, const char *host )
+{
+   nick_t *n;
+
+   if(!(n = pool_alloc( &IRC_CONN->nick_pool ))) return NULL;
+   n->big    = NULL;
+   n->chans  = NULL;
+   n->nchans = 0;
+   n->acl    = 0;
+   n->privs  = 0;
+   n->id     = ++IRC_CONN->nickid;
+   if(nickpack( n, nick, ident, host ) != RETURN_OK ||
+      hmap_put( &IRC_CONN->nicks, n->key.hash, n ) != RETURN_OK)
+   { xfree(n->big); pool_free( &IRC_CONN->nick_pool, n ); return NULL; }
+   return n;
+}
 
-   /* check if user is OP */
-   if(!isop(user))
+/* OP privileged users that are not already */
+static void autoop( usr_t *u )
+{
+   if(!(u->chan->flags & CHAN_AUTOOP) || (u->modes & USR_OP) || !(usrprivs( u ) & USR_OP))
       return;
 
-   /* OP him */
-   set_mode(user, "+o");
+   set_mode( &u->user, "+o" );
 }
 
-/* BOT CODE BELOW */
-static char *str_replace(const char *s, const char *old, const char *new)
-{
-  size_t slen = strlen(s)+1;
-  char *cout=0, *p=0, *tmp=NULL; cout=malloc(slen); p=cout;
-  if( !p )
-    return 0;
-  while( *s )
-    if( !strncmp(s, old, strlen(old)) )
-    {
-      p  -= (intptr_t)cout;
-      cout= realloc(cout, slen += strlen(new)-strlen(old) );
-      tmp = strcpy(p=cout+(intptr_t)p, new);
-      p  += strlen(tmp);
-      s  += strlen(old);
-    }
-    else
-     *p++=*s++;
-
-  *p=0;
-  return cout;
+/* link the nick into the channel, NULL when it does not fit */
+static usr_t* newusr( chan_t *c, nick_t *n, uint8_t modes )
+{
+   usr_t *u;
+
+   if(!(u = pool_alloc( &IRC_CONN->usr_pool ))) return NULL;
+   u->nick  = n;
+   u->chan  = c;
+   u->modes = modes;
+   memset( u->flood, 0, sizeof(u->flood) );
+   u->user.nick    = n->nick;
+   u->user.ident   = n->ident;
+   u->user.host    = n->host;
+   u->user.channel = c->name;
+   u->user.privs   = n->privs;
+   u->user.nkey    = u->user.ckey = NULL;
+   if(hmap_put( &IRC_CONN->usrs, usrhash(c, n), u ) != RETURN_OK)
+   { pool_free( &IRC_CONN->usr_pool, u ); return NULL; }
+
+   u->prev = NULL;
+   if((u->next = c->members)) u->next->prev = u;
+   c->members = u;
+   c->nmembers++;
+
+   u->cprev = NULL;
+   if((u->cnext = n->chans)) u->cnext->cprev = u;
+   n->chans = u;
+   n->nchans++;
+   return u;
 }
 
-static int strsplit(char ***dst, const char *str, const char *token) {
-   char *saveptr, *ptr, *start;
-   int32_t t_len, i;
+/* the record of the sender, NULL for private messages */
+static usr_t* addusr( const user_info *user )
+{
+   char buf[ KEY_MAX ];
+   casekey_t k;
+   nick_t *n;
+   usr_t *u;
+   chan_t *c;
 
-   if (!(saveptr=strdup(str)))
-      return 0;
+   if(!(c = chanfind( chankey( user, &k, buf ) ))) return NULL; /* private message */
 
-   *dst=NULL;
-   t_len=strlen(token);
-   i=0;
+   if(banlist_find( &c->bans, user )) kick_reply( user, REPLY_BANNED, NULL );
+   if((n = nickfind( nickkey( user, &k, buf ) )))
+   {
+      if(strcmp(n->ident, user->ident) || strcmp(n->host, user->host))
+      {
+         /* loaded from NAMES, first time we see the host */
+         nickpack( n, n->nick, user->ident, user->host );
+         for(u = n->chans; u; u = u->cnext) autoop( u );
+      }
+      if((u = usrget( c, n ))) return u;
+   }
+   else if(!(n = newnick( user->nick, user->ident, user->host ))) return NULL;
 
-   for (start=saveptr,ptr=start;;ptr++) {
-      if (!strncmp(ptr,token,t_len) || !*ptr) {
-         while (!strncmp(ptr,token,t_len)) {
-            *ptr=0;
-            ptr+=t_len;
-         }
+   if(!(u = newusr( c, n, 0 )))
+   { if(!n->nchans) delnick( n ); return NULL; }
 
-         if (!((*dst)=realloc(*dst,(i+2)*sizeof(char*))))
-            return 0;
-         (*dst)[i]=start;
-         (*dst)[i+1]=NULL;
-         i++;
+#if DEBUG
+   printf( "$ ADDUSR %s!%s %s\n", user->nick, user->ident, user->channel );
+#endif
 
-         if (!*ptr)
-            break;
-         start=ptr;
-      }
-   }
-   return i;
+   usrprivs( u );
+   autoop( u );
+   return u;
 }
 
-static void strsplit_clear(char ***dst) {
-   if ((*dst)[0])
-      free((*dst)[0]);
-   free((*dst));
+/* count one event, the buckets passed since the last one are emptied */
+static uint16_t floodcount( floodwin_t *w, uint32_t window, uint64_t now )
+{
+   uint32_t b = now / (window / FLOOD_BUCKETS ? window / FLOOD_BUCKETS : 1), i;
+
+   if(b - w->last >= FLOOD_BUCKETS)
+   { memset( w->bucket, 0, sizeof(w->bucket) ); w->sum = 0; }
+   else for(i = w->last + 1; i != b + 1; ++i)
+   { w->sum -= w->bucket[ i % FLOOD_BUCKETS ]; w->bucket[ i % FLOOD_BUCKETS ] = 0; }
+   w->last = b;
+
+   if(w->bucket[ b % FLOOD_BUCKETS ] != UINT8_MAX)
+   { w->bucket[ b % FLOOD_BUCKETS ]++; w->sum++; }
+   return( w->sum );
 }
 
-static int ircconnect( const char *irc_server, int port, const char *nick )
+/* FNV-1a, 64 bits so different people never share a record */
+static uint64_t floodid( const casekey_t *ckey, const casekey_t *nkey, const user_info *user )
 {
-   char buffer[BUFFER_SIZE];
-   struct hostent *he;
-   struct sockaddr_in server;
+   const char *part[4] = { ckey->name, nkey->name, user->ident, user->host };
+   uint64_t hash = 14695981039346656037ull;
+   const char *p;
+   size_t i;
 
-   if(!(he = gethostbyname(irc_server)))
-   {
-      puts("-!- Invalid server");
-      return( RETURN_FAIL );
-   }
-   printf("-!- Hostname: %s\n", he->h_name);
-   printf("-!- IP: %s\n", (inet_ntoa(*((struct in_addr *) he->h_addr))));
-   printf("-!- Connecting to port: %d\n", port);
-   if((IRC_SOCKET = socket(AF_INET, SOCK_STREAM, 0)) == -1)
+   i = 0;
+   for(; i != 4; ++i)
    {
-      puts("-!- Socket creation failed");
-      return( RETURN_FAIL );
+      for(p = part[i]; *p; ++p) hash = (hash ^ (uint8_t)*p) * 1099511628211ull;
+      hash = (hash ^ 0xff) * 1099511628211ull; /* "ab","c" is not "a","bc" */
    }
+   return hash;
+}
+
+static uint32_t floodhash( uint64_t id )
+{
+   return( (uint32_t)(id ^ (id >> 32)) );
+}
+
+static int floodcmp( const void *value, const void *key )
+{
+   return( ((const floodrec_t*)value)->id == *(const uint64_t*)key );
+}
 
-   server.sin_family = AF_INET;
-   server.sin_port   = htons(port);
-   server.sin_addr   = *((struct in_addr *)he->h_addr);
-   bzero(&(server.sin_zero), 8);
+/* NULL when out of memory, the event is let through then */
+static floodrec_t* floodrec( const casekey_t *ckey, const casekey_t *nkey, const user_info *user, uint64_t now )
+{
+   uint64_t id = floodid( ckey, nkey, user );
+   floodrec_t *r;
 
-   if(connect(IRC_SOCKET, (struct sockaddr *)&server, sizeof(struct sockaddr)) == -1)
+   if(!(r = hmap_get( &IRC_CONN->floods, floodhash(id), floodcmp, &id )))
    {
-      puts("-!- Connection failed");
-      return( RETURN_FAIL );
+      if(!(r = pool_alloc( &IRC_CONN->flood_pool ))) return NULL;
+      memset( r, 0, sizeof(floodrec_t) );
+      r->id = id;
+      if(hmap_put( &IRC_CONN->floods, floodhash(id), r ) != RETURN_OK)
+      { pool_free( &IRC_CONN->flood_pool, r ); return NULL; }
    }
-   puts("-!- Connected");
-   puts("-!- Sending nick");
+   r->seen = now;
+   return r;
+}
 
-   snprintf(buffer, BUFFER_SIZE,
-            "NICK %s\r\nUSER %s \"\" \"%s\" :x\r\n", nick, nick,
-            (inet_ntoa(*((struct in_addr *) he->h_addr)))
-            );
-   send(IRC_SOCKET, buffer, strlen(buffer) * sizeof(char), 0);
+static int floodkeep( void *value, const void *ctx )
+{
+   floodrec_t *r = value;
 
-   return( RETURN_OK );
+   if(r->seen >= *(const uint64_t*)ctx) return 1;
+   pool_free( &IRC_CONN->flood_pool, r );
+   return 0;
 }
 
-static size_t parseuserinfo( user_info *user, char *buffer, const char *CMD )
+/* records quiet for longer than the longest window count nothing */
+static void floodsweep( uint64_t now )
 {
-   size_t i, p;
-   uint8_t parse_channel = 0;
+   uint64_t since;
+   uint32_t longest = 0;
+   size_t i;
 
-   memset( user->nick,     0, NICK_MAX    * sizeof(char));
-   memset( user->ident,    0, IDENT_MAX   * sizeof(char));
-   memset( user->channel,  0, CHANNEL_MAX * sizeof(char));
+   i = 0;
+   for(; i != LENGTH(IRC_FLOOD); ++i)
+      if(IRC_FLOOD[i].window > longest) longest = IRC_FLOOD[i].window;
+   if(now < longest) return;
+   since = now - longest;
+   hmap_sweep( &IRC_CONN->floods, floodkeep, &since );
+}
+
+/* RETURN_FAIL when the event should be ignored, ops are never limited.
+ * Commands and lines count on the membership, the rest on a floodrec_t. */
+static int flood( const user_info *user, uint8_t kind )
+{
+   const floodconf_t *f = NULL;
+   const char *vars[ VAR_MAX ] = { NULL };
+   char reason[ LINE_MAX ], cbuf[ KEY_MAX ], nbuf[ KEY_MAX ];
+   const casekey_t *ckey, *nkey;
+   casekey_t ck, nk;
+   floodwin_t *w;
+   floodrec_t *r;
+   uint64_t now;
+   chan_t *c;
+   usr_t *u = NULL;
+   uint16_t n;
+   size_t i;
 
-   /* read nick */
-   p = 0; i = 1;
-   for(; buffer[i] != '!'; ++i)
+   i = 0;
+   for(; i != LENGTH(IRC_FLOOD) && !f; ++i)
+      if(IRC_FLOOD[i].kind == kind) f = &IRC_FLOOD[i];
+   if(!f) return( RETURN_OK );
+
+   now  = now_ms();
+   ckey = chankey( user, &ck, cbuf );
+   nkey = nickkey( user, &nk, nbuf );
+   if((c = chanfind( ckey ))) u = usrfind( c, nkey );
+   if(u && kind < FLOOD_JOIN) w = &u->flood[kind];
+   else if((r = floodrec( ckey, nkey, user, now ))) w = &r->win[kind];
+   else return( RETURN_OK );
+
+   n = floodcount( w, f->window, now );
+   if(n < f->warn && (!f->drop || n < f->drop)) return( RETURN_OK );
+   if(u && (u->modes & USR_OP)) return( RETURN_OK );
+
+   uservars( vars, user );
+   if(f->ban && n >= f->ban && c)
    {
-      if( p > NICK_MAX ) return 0; /* non valid */
-      user->nick[p++] = buffer[i];
+      if(n != f->ban) return( RETURN_FAIL );
+      reason[ tmpl_expand( reason, LINE_MAX - 1, &IRC_TMPL[ REPLY_FLOODED ], vars ) ] = '\0';
+      ban( user, reason );
+      IRC_CONN->metrics.flood_bans++;
+      return( RETURN_FAIL );
    }
-
-   /* read ident */
-   p = 0; i++;
-   for(; !isspace(buffer[i]); ++i)
+   if(f->kick && n >= f->kick && c)
    {
-      if( p > IDENT_MAX ) return 0; /* non valid */
-      if(buffer[i] == '~') continue;
-      user->ident[p++] = buffer[i];
+      if(n == f->kick) { kick_reply( user, REPLY_FLOODED, NULL ); IRC_CONN->metrics.flood_kicks++; }
+      return( RETURN_FAIL );
    }
-
-   /* read target */
-   p = 0;
-   for(; i != strlen(buffer); ++i)
+   if(n == f->warn)
    {
-      if(p == CHANNEL_MAX) break; /* max reached */
-      if(!strncmp(&buffer[i], CMD, strlen(CMD))) { parse_channel = 1; i += strlen(CMD) + 1; }
-      if(buffer[i] == ':') continue;
-      if(parse_channel)
-      {  if(isspace(buffer[i])) break;
-         user->channel[p++] = buffer[i]; }
+      say_reply( REPLY_FLOOD, user->channel, vars );
+      IRC_CONN->metrics.flood_warns++;
    }
-   if(!parse_channel) return 0; /* non valid */
-   if(!strcmp(user->channel, BOT_NICK))
-      snprintf( user->channel, CHANNEL_MAX, "%s", user->nick ); /* PRIVATE MESSAGE */
-
-   return(i); /* return amount read */
+   if(f->drop && n >= f->drop) { IRC_CONN->metrics.flood_drops++; return( RETURN_FAIL ); }
+   return( RETURN_OK );
 }
 
-static uint8_t CHANNEL_JOINED = 0;
-static void joinchannel( const char *channel )
+/* USR_* for a prefix mode letter */
+static uint8_t modeflag( char mode )
 {
-   char buffer[BUFFER_SIZE];
-   if( CHANNEL_JOINED )
-      return;
-
-   snprintf(buffer, BUFFER_SIZE, "JOIN %s\r\n", channel);
-   send(IRC_SOCKET, buffer, strlen(buffer) * sizeof(char), 0);
+   switch(mode)
+   {
+      case 'q': case 'a': case 'o': return USR_OP;
+      case 'h':                     return USR_HALFOP;
+      case 'v':                     return USR_VOICE;
+   }
+   return 0;
 }
 
-static void ping( char *buffer )
+static uint8_t prefixflag( char prefix )
 {
-   size_t i;
-   char ID[BUFFER_SIZE];
-   char message[ BUFFER_SIZE ];
-
-   memset(ID, '\0', BUFFER_SIZE * sizeof(char));
+   const char *p;
 
-   i = 6;
-   for(; buffer[i] != ' ' && buffer[i] != '\0'; ++i)
-      ID[i-6] = buffer[i];
-   snprintf( message, BUFFER_SIZE, HEADER_PONG"%s", ID );
-#if DEBUG
-   puts(message); /* Answer */
-#endif
-
-   send(IRC_SOCKET, message, strlen(message) * sizeof(char), 0 );
-   joinchannel( BOT_CHANNEL );
+   if(!prefix || !(p = strchr(IRC_CONN->isupport.prefixes, prefix))) return 0;
+   return modeflag( IRC_CONN->isupport.prefixmodes[ p - IRC_CONN->isupport.prefixes ] );
 }
 
-static void privmsg( const user_info *user, const char *message )
+/* one "@nick +nick nick!ident@host" NAMES chunk, kept until 366
+ * so the maps can be sized for the whole list */
+static void stagenames( chan_t *c, const char *names )
 {
-   size_t i;
+   size_t len = strlen(names);
+   const char *p;
+   char *buf;
 
-   i = 0;
-   for(; i != LENGTH(MSG_CMD); ++i)
+   if(c->nameslen + len + 2 > c->namescap)
    {
-      if(!strncmp(message, MSG_CMD[i].command, strlen(MSG_CMD[i].command)))
-      {  if(strlen(MSG_CMD[i].command)+1 > strlen(message)) MSG_CMD[i].function( user, "" );
-         else MSG_CMD[i].function( user, message+strlen(MSG_CMD[i].command)+1 );
-         return; }
+      if(!(buf = xrealloc( c->names, (c->nameslen + len + 2) * 2 ))) return;
+      c->names    = buf;
+      c->namescap = (c->nameslen + len + 2) * 2;
    }
+   for(p = names; *p; ++p)
+      if(*p != ' ' && (p == names || p[-1] == ' ')) c->nnames++;
+   memcpy( c->names + c->nameslen, names, len );
+   c->nameslen += len;
+   c->names[ c->nameslen++ ] = ' ';
+   c->names[ c->nameslen ]   = '\0';
+}
+
+static void dropnames( chan_t *c )
+{
+   xfree(c->names);
+   c->names    = NULL;
+   c->nameslen = c->namescap = c->nnames = 0;
 }
 
-static void parsemessage( char *buffer )
+/* link the staged members, marked for loadnames */
+static void linknames( chan_t *c )
 {
-   size_t i, p;
-   uint8_t parse_message = 0;
-   char message[ MESSAGE_MAX + 1 ];
+   char buf[ KEY_MAX ], *names, *nick, *ident, *host;
+   casekey_t k;
+   nick_t *n;
+   usr_t *u;
+   uint8_t i, modes;
 
-   memset( message, '\0', MESSAGE_MAX * sizeof(char));
+   if(!(names = c->names)) return;
 
-   user_info user;
-   i = parseuserinfo( &user, buffer, HEADER_PRIVMSG );
-   if(!i) return;
+   /* one rehash at most instead of one per doubling */
+   hmap_reserve( &IRC_CONN->nicks, c->nnames );
+   hmap_reserve( &IRC_CONN->usrs, c->nnames );
 
-   /* read message */
-   p = 0;
-   for(; i != strlen(buffer); ++i)
+   while(*names)
    {
-      if(p == MESSAGE_MAX) break; /* max reached */
-      if(parse_message) message[p++] = buffer[i];
-      if(buffer[i] == ':') parse_message = 1;
+      for(; *names == ' '; ++names);
+      if(!*names) break;
+      nick = names;
+      for(; *names && *names != ' '; ++names);
+      if(*names) *names++ = '\0';
+
+      /* multi-prefix may give several */
+      for(modes = 0; (i = prefixflag( *nick )); ++nick) modes |= i;
+
+      /* userhost-in-names */
+      if((host = strchr(nick, '@'))) *host++ = '\0';
+      else host = "";
+      if((ident = strchr(nick, '!'))) *ident++ = '\0';
+      else ident = "";
+      for(; *ident == '~'; ++ident);
+
+      if(!*nick || strlen(nick) > IRC_CONN->isupport.nicklen) continue;
+      casekey( &k, buf, sizeof(buf), nick );
+      if(keyeq( &k, &IRC_CONN->me )) continue;
+      if(!(n = nickfind( &k )) && !(n = newnick( nick, ident, host ))) continue;
+      if(*host && !n->host[0]) nickpack( n, n->nick, ident, host );
+
+      if((u = usrget( c, n ))) { u->modes = modes | USR_SEEN | (u->modes & USR_NEW); continue; }
+      if(!newusr( c, n, modes | USR_SEEN | USR_NEW ) && !n->nchans) delnick( n );
    }
-   if(!parse_message) return; /* non valid */
-
-   addusr( &user ); /* if he's been AFK on channel, and bot joined later */
-   privmsg( &user, message );
+   dropnames( c );
 }
 
-static void joinhandle( const user_info *user )
+/* end of NAMES, members it did not list left while we could not see */
+static void loadnames( chan_t *c )
 {
-   size_t i;
+   usr_t *u, *next;
+   size_t added = 0, gone = 0;
 
-   i = 0;
-   for(; i != LENGTH(IRC_PRIV); ++i)
+   linknames( c );
+   for(u = c->members; u; u = next)
    {
-      if(!strcmp(user->nick, IRC_PRIV[i].nick))
-      {
-         if(IRC_PRIV[i].joinfunc) IRC_PRIV[i].joinfunc( user );
-         if(IRC_PRIV[i].priv) set_mode( user, IRC_PRIV[i].priv );
-         return;
-      }
+      next = u->next;
+      if(!(u->modes & USR_SEEN)) { delusr( u ); gone++; continue; }
+      if(!(u->modes & USR_NEW)) { u->modes &= ~USR_SEEN; continue; }
+      u->modes &= ~(USR_SEEN | USR_NEW);
+      added++;
+
+      /* without a host, bans and privileges wait until they speak */
+      if(!u->user.host[0]) continue;
+      if(banlist_find( &c->bans, &u->user )) kick_reply( &u->user, REPLY_BANNED, NULL );
+      autoop( u );
    }
+
+#if DEBUG
+   printf( "$ NAMES %s +%zu -%zu (%zu members)\n", c->name, added, gone, c->nmembers );
+#endif
 }
 
-static void parthandle( const user_info *user )
+/* BOT CODE BELOW */
+static int tmpl_init(void)
 {
    size_t i;
 
    i = 0;
-   for(; i != LENGTH(IRC_PRIV); ++i)
+   for(; i != LENGTH(IRC_REPLIES); ++i)
    {
-      if(!strcmp(user->nick, IRC_PRIV[i].nick))
-      {
-         if(IRC_PRIV[i].partfunc) IRC_PRIV[i].partfunc( user );
-         return;
-      }
+      if(tmpl_compile( &IRC_TMPL[ IRC_REPLIES[i].id ], IRC_REPLIES[i].text ) == RETURN_OK)
+         continue;
+      printf( "-!- Reply template %u has too many pieces\n", IRC_REPLIES[i].id );
+      return( RETURN_FAIL );
    }
+   return( RETURN_OK );
 }
 
-static void parsejoinpart( char *buffer, uint8_t part )
+/* split into literals and placeholders, unknown {names} stay literal */
+static int tmpl_compile( tmpl_t *t, const char *text )
 {
-   user_info user;
+   const char *p, *close;
+   tmplseg_t *s;
+   size_t i, n;
 
-   if(!part) {
-      if(!parseuserinfo( &user, buffer, HEADER_JOIN )) return;
-      if(!strcmp(user.nick, BOT_NICK))
-      {
-         CHANNEL_JOINED = 1;
-         printf("-!- Joined %s\n", user.channel);
-         return;
-      }
-      addusr( &user );
-      joinhandle( &user );
-      JOIN( &user );
-   }
-   else {
-      if(!parseuserinfo( &user, buffer, HEADER_PART )) return;
-      if(!strcmp(user.nick, BOT_NICK))
+   memset( t, 0, sizeof(tmpl_t) );
+   for(p = text; *p; ++t->nseg)
+   {
+      if(t->nseg == TMPL_SEGS) return( RETURN_FAIL );
+      s = &t->seg[ t->nseg ];
+
+      if(*p == '{' && (close = strchr( p, '}' )))
       {
-         CHANNEL_JOINED = 0;
-         printf("-!- Parted %s\n", user.channel);
-         unusr_channel( user.channel );
-         return;
+         n = close - p - 1;
+         for(i = 0; i != VAR_MAX; ++i)
+            if(strlen(TMPL_VARS[i]) == n && !strncmp( p + 1, TMPL_VARS[i], n )) break;
+         if(i != VAR_MAX)
+         {
+            s->var = i;
+            t->vars |= 1u << i;
+            p = close + 1;
+            continue;
+         }
       }
-      unusr( &user );
-      parthandle( &user );
-      PART( &user );
+
+      n = strcspn( p + 1, "{" ) + 1;
+      if(n > UINT16_MAX) return( RETURN_FAIL );
+      s->text = p;
+      s->len  = n;
+      s->var  = VAR_MAX;
+      t->fixed += n;
+      p += n;
    }
+   return( RETURN_OK );
 }
 
-static void parsebuffer( char *buffer )
+/* exact length first, then a single copy pass clipped to room, no terminator */
+static size_t tmpl_expand( char *dst, size_t room, const tmpl_t *t, const char **vars )
 {
-   size_t i;
+   size_t vlen[ VAR_MAX ], len, out, n, i;
+   const tmplseg_t *s;
+   const char *src;
 
    i = 0;
-   for(; buffer[i] != '\0'; ++i)
+   for(; i != VAR_MAX; ++i)
+      vlen[i] = (t->vars & (1u << i)) && vars[i] ? strlen( vars[i] ) : 0;
+
+   len = t->fixed;
+   for(i = 0; i != t->nseg; ++i)
+      if(t->seg[i].var != VAR_MAX) len += vlen[ t->seg[i].var ];
+   if(len > room) len = room; /* clipped */
+
+   out = 0;
+   for(i = 0; i != t->nseg && out != len; ++i)
    {
-      /* PRIVMSG */
-      if(!strncmp(buffer + i, HEADER_PRIVMSG, strlen(HEADER_PRIVMSG)))
-      { parsemessage( buffer ); break; }
-      /* JOIN */
-      else if(!strncmp(buffer + i, HEADER_JOIN, strlen(HEADER_JOIN)))
-      { parsejoinpart( buffer, 0 ); break; }
-      /* PART */
-      else if(!strncmp(buffer + i, HEADER_PART, strlen(HEADER_PART)))
-      { parsejoinpart( buffer, 1 ); break; }
-       /* PART */
-      else if(!strncmp(buffer + i, HEADER_KICK, strlen(HEADER_KICK)))
-      { parsejoinpart( buffer, 1 ); break; }
-      /* PING */
-      else if(!strncmp(buffer + i, HEADER_PING, strlen(HEADER_PING)))
-      { ping( buffer + i ); break; }
-      /* MODE SET FOR <NICK> */
-      else if(!strncmp(buffer + i, MODE_NAME, strlen(MODE_NAME)))
-      { joinchannel( BOT_CHANNEL ); break; }
+      s = &t->seg[i];
+      if(s->var == VAR_MAX) { src = s->text; n = s->len; }
+      else { src = vars[ s->var ]; n = vlen[ s->var ]; }
+      if(n > len - out) n = len - out;
+      memcpy( dst + out, src, n );
+      out += n;
    }
+   return( len );
 }
 
-static void cleanup( int ret )
+#define MEMSTAT(X) __atomic_add_fetch( &IRC_MEM.X, 1, __ATOMIC_RELAXED )
+
+static void* xmalloc( size_t size )
 {
-   clearbans();
-   clearusrs();
-   if(IRC_SOCKET) close(IRC_SOCKET);
-   IRC_SOCKET = 0;
-   exit(ret);
+   MEMSTAT(allocs);
+   return malloc( size );
 }
 
-int main(int argc, char *argv[])
+static void* xcalloc( size_t count, size_t size )
 {
-   size_t bytes, count, i;
-   char buffer[BUFFER_SIZE];
-   char **split = NULL;
+   MEMSTAT(allocs);
+   return calloc( count, size );
+}
 
-   (void)signal(SIGINT,  cleanup);
-   (void)signal(SIGTERM, cleanup);
-   (void)signal(SIGSEGV, cleanup);
-   (void)signal(SIGCHLD, SIG_IGN);
+static void* xrealloc( void *ptr, size_t size )
+{
+   if(ptr) MEMSTAT(reallocs);
+   else MEMSTAT(allocs);
+   return realloc( ptr, size );
+}
 
-   if(ircconnect( BOT_SERVER, BOT_PORT, BOT_NICK ) == RETURN_FAIL)
-      cleanup( EXIT_FAILURE );
+static void xfree( void *ptr )
+{
+   if(ptr) MEMSTAT(frees);
+   free( ptr );
+}
 
-   snprintf( MODE_NAME, BUFFER_SIZE, ":%s MODE %s :", BOT_NICK, BOT_NICK );
-   while(1)
+static uint64_t now_ns(void)
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return( (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec );
+}
+
+static size_t hist_slot( uint64_t ns )
+{
+   unsigned msb;
+
+   if(ns < 8) return ns;
+   msb = 63 - __builtin_clzll( ns );
+   return( 8 + (msb - 3) * 4 + ((ns >> (msb - 2)) & 3) );
+}
+
+/* smallest value that lands in slot */
+static uint64_t hist_floor( size_t slot )
+{
+   unsigned msb;
+
+   if(slot < 8) return slot;
+   msb = (slot - 8) / 4 + 3;
+   return( ((uint64_t)1 << msb) + ((uint64_t)((slot - 8) % 4) << (msb - 2)) );
+}
+
+static void hist_add( hist_t *h, uint64_t ns )
+{
+   h->count++;
+   h->sum += ns;
+   if(ns > h->max) h->max = ns;
+   h->bucket[ hist_slot(ns) ]++;
+}
+
+/* upper edge of the bucket holding the pct'th percentile */
+static uint64_t hist_pct( const hist_t *h, double pct )
+{
+   uint64_t want, seen;
+   size_t i;
+
+   if(!h->count) return 0;
+   want = (uint64_t)(h->count * pct / 100.0);
+   if(want < 1) want = 1;
+
+   seen = 0;
+   i = 0;
+   for(; i != HIST_BUCKETS - 1; ++i)
+      if((seen += h->bucket[i]) >= want) break;
+   if(i == HIST_BUCKETS - 1 || hist_floor(i + 1) - 1 > h->max) return h->max;
+   return( hist_floor(i + 1) - 1 );
+}
+
+static void* pool_alloc( pool_t *pool )
+{
+   void **slabs, *obj;
+   char *slab;
+   size_t i;
+
+   if(!pool->free)
    {
-      memset(buffer, '\0', BUFFER_SIZE);
-      recv(IRC_SOCKET, buffer, BUFFER_SIZE * sizeof(char), 0);
-      send(IRC_SOCKET, "\r\n", strlen("\r\n") * sizeof(char), 0); /* flush */
-      count = strsplit(&split,buffer,"\r\n");
+      if(!(slab = xmalloc( pool->size * pool->count ))) return NULL;
+      if(!(slabs = xrealloc( pool->slabs, (pool->nslabs + 1) * sizeof(void*) )))
+      { xfree(slab); return NULL; }
+      pool->slabs = slabs;
+      pool->slabs[ pool->nslabs++ ] = slab;
 
+      /* thread the new slab into the free list */
       i = 0;
-      for(; i != count; ++i)
+      for(; i != pool->count; ++i)
+      {
+         *(void**)(slab + i * pool->size) = pool->free;
+         pool->free = slab + i * pool->size;
+      }
+   }
+
+   obj = pool->free;
+   pool->free = *(void**)obj;
+   pool->live++;
+   return obj;
+}
+
+static void pool_free( pool_t *pool, void *obj )
+{
+   *(void**)obj = pool->free;
+   pool->free = obj;
+   if(!--pool->live && pool->want) pool_clear( pool ); /* resize that waited */
+}
+
+static void pool_clear( pool_t *pool )
+{
+   size_t i;
+
+   i = 0;
+   for(; i != pool->nslabs; ++i)
+      xfree(pool->slabs[i]);
+   xfree(pool->slabs);
+   pool->slabs  = NULL;
+   pool->nslabs = 0;
+   pool->free   = NULL;
+   pool->live   = 0;
+   if(pool->want) { pool->size = pool->want; pool->want = 0; }
+}
+
+/* new object size, taken once nothing is handed out anymore */
+static void pool_resize( pool_t *pool, size_t size )
+{
+   size = (size + 15) & ~(size_t)15;
+   pool->want = (size == pool->size) ? 0 : size;
+   if(!pool->live && pool->want) pool_clear( pool );
+}
+
+/* arenaalign_t aligned, NULL when out of memory */
+static void* arena_alloc( arena_t *arena, size_t size )
+{
+   arenablk_t *b = arena->blk;
+   size_t want;
+   void *p;
+
+   size = (size + sizeof(arenaalign_t) - 1) / sizeof(arenaalign_t) * sizeof(arenaalign_t);
+   if(!b || b->used + size > b->size)
+   {
+      want = b ? b->size * 2 : ARENA_SIZE;
+      if(want < size) want = size;
+      if(!(b = xmalloc( sizeof(arenablk_t) + want ))) return NULL;
+      b->size = want;
+      b->used = 0;
+      b->next = arena->blk;
+      arena->blk    = b;
+      arena->total += want;
+   }
+
+   p = (char*)b->data + b->used;
+   b->used += size;
+   return p;
+}
+
+/* Everything handed out is gone. Blocks added while handling the line
+ * are folded into one that fits it all, so the next one needs none. */
+static void arena_reset( arena_t *arena )
+{
+   size_t total = arena->total;
+
+   if(!arena->blk) return;
+   if(!arena->blk->next) { arena->blk->used = 0; return; }
+
+   arena_clear( arena );
+   if((arena->blk = xmalloc( sizeof(arenablk_t) + total )))
+   {
+      arena->blk->size = arena->total = total;
+      arena->blk->used = 0;
+      arena->blk->next = NULL;
+   }
+}
+
+static void arena_clear( arena_t *arena )
+{
+   arenablk_t *b, *next;
+
+   for(b = arena->blk; b; b = next)
+   { next = b->next; xfree(b); }
+   arena->blk   = NULL;
+   arena->total = 0;
+}
+
+/* FNV-1a, chain calls to hash several strings */
+static uint32_t strhash( uint32_t hash, const char *str )
+{
+   for(; *str; ++str)
+      hash = (hash ^ (uint8_t)*str) * 16777619u;
+   return hash;
+}
+
+/* by eCASEMAP, rfc1459 also folds []\~ to {}|^, strict leaves ~ */
+static uint8_t IRC_FOLD[ CASEMAP_MAX ][ 256 ];
+
+static void casemap_init(void)
+{
+   size_t m, i;
+
+   m = 0;
+   for(; m != CASEMAP_MAX; ++m)
+   {
+      for(i = 0; i != 256; ++i) IRC_FOLD[m][i] = (i >= 'A' && i <= 'Z') ? i + ('a' - 'A') : i;
+      if(m == CASEMAP_ASCII) continue;
+      IRC_FOLD[m]['['] = '{';
+      IRC_FOLD[m][']'] = '}';
+      IRC_FOLD[m]['\\'] = '|';
+      if(m == CASEMAP_RFC1459) IRC_FOLD[m]['~'] = '^';
+   }
+}
+
+/* fold and hash in one pass, the key points at buf */
+static void casekey( casekey_t *k, char *buf, size_t size, const char *s )
+{
+   const uint8_t *fold = IRC_FOLD[ IRC_CONN->isupport.casemap ];
+   uint32_t hash = HASH_SEED;
+   size_t n = 0;
+
+   for(; s[n] && n + 1 < size; ++n)
+   {
+      buf[n] = fold[ (uint8_t)s[n] ];
+      hash = (hash ^ (uint8_t)buf[n]) * 16777619u;
+   }
+   buf[n]  = '\0';
+   k->hash = hash;
+   k->len  = n;
+   k->name = buf;
+}
+
+static int keyeq( const casekey_t *a, const casekey_t *b )
+{
+   return( a->hash == b->hash && a->len == b->len && !memcmp(a->name, b->name, a->len) );
+}
+
+static int isme( const char *nick )
+{
+   char buf[ KEY_MAX ];
+   casekey_t k;
+
+   casekey( &k, buf, sizeof(buf), nick );
+   return keyeq( &k, &IRC_CONN->me );
+}
+
+/* the key msgtouser folded, or folded now into buf of KEY_MAX */
+static const casekey_t* nickkey( const user_info *user, casekey_t *k, char *buf )
+{
+   if(user->nkey) return user->nkey;
+   casekey( k, buf, KEY_MAX, user->nick );
+   return k;
+}
+
+static const casekey_t* chankey( const user_info *user, casekey_t *k, char *buf )
+{
+   if(user->ckey) return user->ckey;
+   casekey( k, buf, KEY_MAX, user->channel );
+   return k;
+}
+
+/* identity folded into buf for matching bans, channel left as is */
+static int userfold( user_info *dst, char *buf, size_t size, const user_info *src )
+{
+   const uint8_t *fold = IRC_FOLD[ IRC_CONN->isupport.casemap ];
+   char *p;
+
+   if(userpack( dst, buf, size, src ) != RETURN_OK) return( RETURN_FAIL );
+   p = buf;
+   if(src->nkey) { memcpy( p, src->nkey->name, src->nkey->len ); p = (char*)dst->ident; }
+   for(; p != dst->channel; ++p) *p = fold[ (uint8_t)*p ];
+   return( RETURN_OK );
+}
+
+/* CASEMAPPING changed, every key is folded again and the maps rebuilt.
+ * Two nicks folding the same now can not both be there, the later goes. */
+static void rekey(void)
+{
+   hmap_t chans = IRC_CONN->chans, nicks = IRC_CONN->nicks;
+   chan_t *c;
+   nick_t *n;
+   usr_t *u, *next;
+   size_t i;
+
+   IRC_CONN->keymap = IRC_CONN->isupport.casemap;
+   casekey( &IRC_CONN->me, IRC_CONN->mekey, KEY_MAX, IRC_CONN->menick );
+   acl_compile();
+
+   hmap_clear( &IRC_CONN->usrs );
+   memset( &IRC_CONN->nicks, 0, sizeof(hmap_t) );
+   hmap_reserve( &IRC_CONN->nicks, nicks.count );
+   for(i = 0; nicks.slots && i != nicks.mask + 1; ++i)
+   {
+      if(!(n = nicks.slots[i].value)) continue;
+      casekey( &n->key, (char*)n->key.name, n->key.len + 1, n->nick );
+      if(nickfind( &n->key ) || hmap_put( &IRC_CONN->nicks, n->key.hash, n ) != RETURN_OK)
+      {
+         while(n->chans) unlinkusr( n->chans );
+         xfree(n->big);
+         pool_free( &IRC_CONN->nick_pool, n );
+      }
+   }
+   hmap_clear( &nicks );
+
+   memset( &IRC_CONN->chans, 0, sizeof(hmap_t) );
+   hmap_reserve( &IRC_CONN->chans, chans.count );
+   for(i = 0; chans.slots && i != chans.mask + 1; ++i)
+   {
+      if(!(c = chans.slots[i].value)) continue;
+      casekey( &c->key, (char*)c->key.name, c->key.len + 1, c->name );
+      hmap_put( &IRC_CONN->chans, c->key.hash, c );
+
+      for(u = c->members; u; u = next)
       {
+         next = u->next;
+         if(hmap_put( &IRC_CONN->usrs, usrhash(c, u->nick), u ) != RETURN_OK) delusr( u );
+      }
+      banlist_rekey( &c->bans );
+   }
+   hmap_clear( &chans );
+
 #if DEBUG
-         printf("# %s\n", split[i]);
+   printf( "$ REKEY casemap %u, %zu channels %zu nicks %zu members\n", IRC_CONN->keymap, IRC_CONN->chans.count, IRC_CONN->nicks.count, IRC_CONN->usrs.count );
 #endif
-         parsebuffer(split[i]);
+}
+
+static void* hmap_get( const hmap_t *map, uint32_t hash, hmap_eq *eq, const void *key )
+{
+   size_t i;
+
+   if(!map->slots) return NULL;
+
+   i = hash & map->mask;
+   for(; map->slots[i].value; i = (i + 1) & map->mask)
+      if(map->slots[i].hash == hash && eq( map->slots[i].value, key ))
+         return map->slots[i].value;
+   return NULL;
+}
+
+static int hmap_resize( hmap_t *map, size_t cap )
+{
+   hslot_t *old = map->slots;
+   size_t i, j;
+
+   if(!(map->slots = xcalloc( cap, sizeof(hslot_t) )))
+   { map->slots = old; return( RETURN_FAIL ); }
+
+   i = 0;
+   for(; old && i != map->mask + 1; ++i)
+   {
+      if(!old[i].value) continue;
+      j = old[i].hash & (cap - 1);
+      for(; map->slots[j].value; j = (j + 1) & (cap - 1));
+      map->slots[j] = old[i];
+   }
+
+   map->mask = cap - 1;
+   xfree(old);
+   return( RETURN_OK );
+}
+
+/* caller makes sure the key is not in the map already */
+static int hmap_put( hmap_t *map, uint32_t hash, void *value )
+{
+   size_t i;
+
+   if(!map->slots || (map->count + 1) * 4 > (map->mask + 1) * 3)
+      if(hmap_resize( map, map->slots ? (map->mask + 1) * 2 : 64 ) != RETURN_OK)
+         return( RETURN_FAIL );
+
+   i = hash & map->mask;
+   for(; map->slots[i].value; i = (i + 1) & map->mask);
+   map->slots[i].hash  = hash;
+   map->slots[i].value = value;
+   map->count++;
+   return( RETURN_OK );
+}
+
+/* make room for count more entries with at most one rehash */
+static int hmap_reserve( hmap_t *map, size_t count )
+{
+   size_t cap = map->slots ? map->mask + 1 : 64;
+
+   while((map->count + count) * 4 > cap * 3) cap *= 2;
+   if(map->slots && cap == map->mask + 1) return( RETURN_OK );
+   return hmap_resize( map, cap );
+}
+
+/* empty slot i, shifting back entries of the same cluster */
+static void hmap_unslot( hmap_t *map, size_t i )
+{
+   size_t j = i, home;
+
+   while(1)
+   {
+      map->slots[i].value = NULL;
+      do {
+         j = (j + 1) & map->mask;
+         if(!map->slots[j].value) return;
+         home = map->slots[j].hash & map->mask;
+      } while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+      map->slots[i] = map->slots[j];
+      i = j;
+   }
+}
+
+static void* hmap_del( hmap_t *map, uint32_t hash, hmap_eq *eq, const void *key )
+{
+   void *value;
+   size_t i;
+
+   if(!map->slots) return NULL;
+
+   i = hash & map->mask;
+   for(; map->slots[i].value; i = (i + 1) & map->mask)
+      if(map->slots[i].hash == hash && eq( map->slots[i].value, key ))
+      {
+         value = map->slots[i].value;
+         hmap_unslot( map, i );
+         map->count--;
+         return value;
+      }
+   return NULL;
+}
+
+/* drop every value keep() rejects in a single pass over the slots */
+static void hmap_sweep( hmap_t *map, hmap_keep *keep, const void *ctx )
+{
+   size_t i, n, start;
+
+   if(!map->slots || !map->count) return;
+
+   /* start after an empty slot so shifted entries never wrap behind us */
+   start = 0;
+   for(; map->slots[start].value; ++start);
+
+   n = 0;
+   i = (start + 1) & map->mask;
+   for(; n != map->mask; ++n)
+   {
+      while(map->slots[i].value && !keep( map->slots[i].value, ctx ))
+      { hmap_unslot( map, i ); map->count--; }
+      i = (i + 1) & map->mask;
+   }
+}
+
+static void hmap_clear( hmap_t *map )
+{
+   xfree(map->slots);
+   map->slots = NULL;
+   map->mask  = 0;
+   map->count = 0;
+}
+
+/* '*' and '?' wildcards */
+static int globmatch( const char *pat, const char *str )
+{
+   const char *star = NULL, *retry = NULL;
+
+   while(*str)
+   {
+      if(*pat == '*') { star = ++pat; retry = str; }
+      else if(*pat == '?' || *pat == *str) { ++pat; ++str; }
+      else if(star) { pat = star; str = ++retry; }
+      else return 0;
+   }
+   for(; *pat == '*'; ++pat);
+   return( !*pat );
+}
+
+static void matcher_compile( matcher_t *m, const char *pat )
+{
+   m->pat = pat;
+   if(!strcmp(pat, "*"))                         m->type = MATCH_ANY;
+   else if(!strpbrk(pat, "*?"))                  m->type = MATCH_EXACT;
+   else if(pat[0] == '*' && pat[1] == '.' && !strpbrk(pat + 1, "*?"))
+   { m->pat = pat + 1;                           m->type = MATCH_SUFFIX; }
+   else                                          m->type = MATCH_GLOB;
+}
+
+static int matcher_match( const matcher_t *m, const char *str )
+{
+   size_t len, plen;
+
+   switch(m->type)
+   {
+      case MATCH_ANY:   return 1;
+      case MATCH_EXACT: return( !strcmp(m->pat, str) );
+      case MATCH_SUFFIX:
+         len = strlen(str); plen = strlen(m->pat);
+         return( len >= plen && !memcmp(str + len - plen, m->pat, plen) );
+      default:          return( globmatch(m->pat, str) );
+   }
+}
+
+/* Split nick!ident@host into ban pattern, missing parts match anything.
+ * b->pat and b->text hold strlen(mask) + 5 bytes, text keeps the case. */
+static int mask_compile( ban_t *b, const char *mask )
+{
+   const uint8_t *fold = IRC_FOLD[ IRC_CONN->isupport.casemap ];
+   char *bang, *at, *nick, *ident, *host, *p;
+   size_t len = strlen(mask);
+
+   memmove( b->pat, mask, len + 1 );
+
+   nick = b->pat; ident = "*"; host = "*";
+   if((at = strchr(nick, '@')))     { *at = '\0';   host  = at + 1; }
+   if((bang = strchr(nick, '!')))   { *bang = '\0'; ident = bang + 1; }
+   for(; *ident == '~'; ++ident);
+   if(!*nick)  nick  = "*";
+   if(!*ident) ident = "*";
+   if(!*host)  host  = "*";
+
+   sprintf( b->text, "%s!%s@%s", nick, ident, host );
+   for(p = b->pat; p != b->pat + len; ++p) *p = fold[ (uint8_t)*p ];
+   matcher_compile( &b->match[ MASK_NICK ],  nick );
+   matcher_compile( &b->match[ MASK_IDENT ], ident );
+   matcher_compile( &b->match[ MASK_HOST ],  host );
+
+   /* index on the most selective literal part */
+   if(b->match[ MASK_NICK ].type == MATCH_EXACT)        b->index = BAN_NICK;
+   else if(b->match[ MASK_IDENT ].type == MATCH_EXACT)  b->index = BAN_IDENT;
+   else if(b->match[ MASK_HOST ].type == MATCH_EXACT)   b->index = BAN_HOST;
+   else if(b->match[ MASK_HOST ].type == MATCH_SUFFIX)  b->index = BAN_SUFFIX;
+   else                                                 b->index = BAN_GLOB;
+   return( RETURN_OK );
+}
+
+static int banmatch( const ban_t *b, const user_info *user )
+{
+   return( matcher_match( &b->match[ MASK_NICK ],  user->nick )  &&
+           matcher_match( &b->match[ MASK_IDENT ], user->ident ) &&
+           matcher_match( &b->match[ MASK_HOST ],  user->host ) );
+}
+
+static const char* bankey( const ban_t *b )
+{
+   return b->match[ b->index == BAN_SUFFIX ? MASK_HOST : b->index ].pat;
+}
+
+static uint32_t bankeyhash( uint8_t index, const char *key )
+{
+   return strhash( HASH_SEED ^ index, key );
+}
+
+static int bankeycmp( const void *value, const void *key )
+{
+   const ban_t    *b = value;
+   const bankey_t *k = key;
+   return( b->index == k->index && !strcmp(bankey(b), k->key) );
+}
+
+static int banvictimcmp( const void *value, const void *key )
+{
+   return keyeq( &((const ban_t*)value)->vkey, key );
+}
+
+static ban_t* banprobe( const banlist_t *bl, uint8_t index, const char *key, const user_info *user )
+{
+   bankey_t k = { index, key };
+   ban_t *b = hmap_get( &bl->index, bankeyhash(index, key), bankeycmp, &k );
+
+   for(; b; b = b->next)
+      if(banmatch( b, user )) return b;
+   return NULL;
+}
+
+static ban_t* banlist_lookup( const banlist_t *bl, const user_info *user )
+{
+   const char *dot;
+   ban_t *b;
+
+   if((b = banprobe( bl, BAN_NICK,  user->nick,  user ))) return b;
+   if((b = banprobe( bl, BAN_IDENT, user->ident, user ))) return b;
+   if((b = banprobe( bl, BAN_HOST,  user->host,  user ))) return b;
+   for(dot = user->host; (dot = strchr(dot, '.')); ++dot)
+      if((b = banprobe( bl, BAN_SUFFIX, dot, user ))) return b;
+
+   for(b = bl->glob; b; b = b->next)
+      if(banmatch( b, user )) return b;
+   return NULL;
+}
+
+/* the user is folded once, the bans were folded when compiled */
+static ban_t* banlist_find( const banlist_t *bl, const user_info *user )
+{
+   char buf[ LINE_MAX ];
+   uint64_t start = 0;
+   user_info folded;
+   ban_t *b;
+
+   if(!bl->count) return NULL;
+   if(userfold( &folded, buf, sizeof(buf), user ) != RETURN_OK) return NULL;
+   if(IRC_STATS) start = now_ns();
+   b = banlist_lookup( bl, &folded );
+   if(!IRC_STATS) return b;
+   hist_add( &IRC_CONN->metrics.ban_check, now_ns() - start );
+   IRC_CONN->metrics.ban_checks++;
+   if(b) IRC_CONN->metrics.ban_hits++;
+   return b;
+}
+
+static ban_t* banlist_mask( const banlist_t *bl, const char *mask )
+{
+   char pat[ LINE_MAX + 5 ], text[ LINE_MAX + 5 ];
+   ban_t tmp, *b;
+   bankey_t k;
+   size_t i;
+
+   if(strlen(mask) >= LINE_MAX) return NULL;
+   tmp.pat = pat; tmp.text = text;
+   if(mask_compile( &tmp, mask ) != RETURN_OK) return NULL;
+
+   if(tmp.index == BAN_GLOB) b = bl->glob;
+   else {
+      k.index = tmp.index; k.key = bankey(&tmp);
+      b = hmap_get( &bl->index, bankeyhash(k.index, k.key), bankeycmp, &k );
+   }
+
+   for(; b; b = b->next)
+   {
+      for(i = 0; i != MASK_PARTS && b->match[i].type == tmp.match[i].type &&
+                 !strcmp(b->match[i].pat, tmp.match[i].pat); ++i);
+      if(i == MASK_PARTS) return b;
+   }
+   return NULL;
+}
+
+static ban_t* banlist_victim( const banlist_t *bl, const char *nick )
+{
+   char buf[ KEY_MAX ];
+   casekey_t k;
+
+   casekey( &k, buf, sizeof(buf), nick );
+   return hmap_get( &bl->victims, k.hash, banvictimcmp, &k );
+}
+
+static ban_t* banlist_add( banlist_t *bl, const char *mask, const user_info *user, const char *reason )
+{
+   ban_t *b;
+   size_t rlen, mlen, ulen;
+
+   if(!reason) reason = "";
+   rlen = strlen(reason) + 1;
+   mlen = strlen(mask) + 5;
+   ulen = user ? userlen( user ) + strlen(user->nick) + 1 : 0;
+
+   if(!(b = pool_alloc( &IRC_CONN->ban_pool ))) return NULL;
+   memset( b, 0, sizeof(ban_t) );
+   if(!(b->reason = xmalloc( rlen + mlen * 2 + ulen ))) { pool_free( &IRC_CONN->ban_pool, b ); return NULL; }
+   memcpy( b->reason, reason, rlen );
+   b->pat  = b->reason + rlen;
+   b->text = b->pat + mlen;
+   if(mask_compile( b, mask ) != RETURN_OK) { xfree(b->reason); pool_free( &IRC_CONN->ban_pool, b ); return NULL; }
+   if(user)
+   {
+      userpack( &b->user, b->text + mlen, ulen, user );
+      casekey( &b->vkey, (char*)b->user.channel + strlen(b->user.channel) + 1, strlen(user->nick) + 1, user->nick );
+   }
+   else { b->user.nick = b->user.ident = b->user.host = b->user.channel = ""; b->user.privs = 0; b->user.nkey = b->user.ckey = NULL; }
+
+   if(banlist_link( bl, b ) != RETURN_OK)
+   { xfree(b->reason); pool_free( &IRC_CONN->ban_pool, b ); return NULL; }
+   return b;
+}
+
+/* into the index and the victims, RETURN_FAIL leaves b out of both */
+static int banlist_link( banlist_t *bl, ban_t *b )
+{
+   ban_t *head;
+   bankey_t k;
+   uint32_t hash;
+
+   b->next = b->vnext = NULL;
+   if(b->index == BAN_GLOB) { b->next = bl->glob; bl->glob = b; }
+   else {
+      k.index = b->index; k.key = bankey(b);
+      hash = bankeyhash( k.index, k.key );
+      if((head = hmap_del( &bl->index, hash, bankeycmp, &k ))) b->next = head;
+      if(hmap_put( &bl->index, hash, b ) != RETURN_OK)
+      {
+         if(head) hmap_put( &bl->index, hash, head );
+         return( RETURN_FAIL );
       }
-      strsplit_clear(&split);
-      if(!strlen(buffer)) break; /* something is wrong */
    }
 
+   if(b->user.nick[0])
+   {
+      if((head = hmap_del( &bl->victims, b->vkey.hash, banvictimcmp, &b->vkey ))) b->vnext = head;
+      if(hmap_put( &bl->victims, b->vkey.hash, b ) != RETURN_OK)
+      { if(head) hmap_put( &bl->victims, b->vkey.hash, head ); b->vnext = NULL; b->user.nick = ""; }
+   }
+
+   bl->count++;
+   return( RETURN_OK );
+}
+
+static void banlist_del( banlist_t *bl, ban_t *b )
+{
+   ban_t *c, **cc;
+   bankey_t k;
+   uint32_t hash;
+
+#if DEBUG
+   printf( "$ DELBAN %s %s\n", b->text, b->user.channel );
+#endif
+
+   if(b->index == BAN_GLOB) cc = &bl->glob;
+   else {
+      k.index = b->index; k.key = bankey(b);
+      hash = bankeyhash( k.index, k.key );
+      c = hmap_get( &bl->index, hash, bankeycmp, &k );
+      if(c == b) { hmap_del( &bl->index, hash, bankeycmp, &k ); if(b->next) hmap_put( &bl->index, hash, b->next ); }
+      cc = &c;
+   }
+   for(; *cc; cc = &(*cc)->next)
+      if(*cc == b) { *cc = b->next; break; }
+
+   if(b->user.nick[0])
+   {
+      c = hmap_get( &bl->victims, b->vkey.hash, banvictimcmp, &b->vkey );
+      if(c == b) { hmap_del( &bl->victims, b->vkey.hash, banvictimcmp, &b->vkey ); if(b->vnext) hmap_put( &bl->victims, b->vkey.hash, b->vnext ); }
+      else for(; c; c = c->vnext)
+         if(c->vnext == b) { c->vnext = b->vnext; break; }
+   }
+
+   bl->count--;
+   xfree(b->reason);
+   pool_free( &IRC_CONN->ban_pool, b );
+}
+
+static int dropban( void *value, const void *ctx )
+{
+   ban_t *b = value, *next;
+
+   (void)ctx;
+   for(; b; b = next)
+   { next = b->next; xfree(b->reason); pool_free( &IRC_CONN->ban_pool, b ); }
+   return 0;
+}
+
+static void banlist_clear( banlist_t *bl )
+{
+   hmap_sweep( &bl->index, dropban, NULL );
+   dropban( bl->glob, NULL );
+   hmap_clear( &bl->index );
+   hmap_clear( &bl->victims );
+   bl->glob  = NULL;
+   bl->count = 0;
+}
+
+/* CASEMAPPING changed, compile every ban again from its text */
+static void banlist_rekey( banlist_t *bl )
+{
+   char mask[ LINE_MAX + 5 ];
+   ban_t *all = NULL, *b, *next;
+   size_t i;
+
+   i = 0;
+   for(; bl->index.slots && i != bl->index.mask + 1; ++i)
+      for(b = bl->index.slots[i].value; b; b = next) { next = b->next; b->next = all; all = b; }
+   for(b = bl->glob; b; b = next) { next = b->next; b->next = all; all = b; }
+   hmap_clear( &bl->index );
+   hmap_clear( &bl->victims );
+   bl->glob  = NULL;
+   bl->count = 0;
+
+   for(b = all; b; b = next)
+   {
+      next = b->next;
+      strcpy( mask, b->text ); /* never longer than the mask it came from + 4 */
+      mask_compile( b, mask );
+      if(b->user.nick[0]) casekey( &b->vkey, (char*)b->vkey.name, b->vkey.len + 1, b->user.nick );
+      if(banlist_link( bl, b ) != RETURN_OK) { xfree(b->reason); pool_free( &IRC_CONN->ban_pool, b ); }
+   }
+}
+
+/* IRC_PRIV is folded with the casemap, so it is compiled again on
+ * every rekey. Records compare aclgen and resolve lazily after that. */
+static void acl_compile(void)
+{
+   aclent_t *a;
+   const char *p;
+   size_t i;
+
+   i = 0;
+   for(; i != LENGTH(IRC_PRIV); ++i)
+   {
+      a = &IRC_CONN->acl[i];
+      memset( a, 0, sizeof(aclent_t) );
+      if(i >= 32 || strlen(IRC_PRIV[i].mask) > ACL_MASK_MAX)
+      { printf( "-!- Privilege mask %s ignored\n", IRC_PRIV[i].mask ); continue; }
+
+      a->mask.pat  = a->pat;
+      a->mask.text = a->text;
+      mask_compile( &a->mask, IRC_PRIV[i].mask );
+      for(p = IRC_PRIV[i].priv; p && *p; ++p) a->privs |= modeflag( *p );
+      a->ok = 1;
+   }
+   if(!++IRC_CONN->aclgen) ++IRC_CONN->aclgen; /* 0 means unresolved */
+}
+
+/* bit i set when IRC_PRIV[i] matches, the user is folded once */
+static uint32_t acl_match( const user_info *user )
+{
+   char buf[ LINE_MAX ];
+   user_info folded;
+   uint32_t acl = 0;
+   size_t i;
+
+   if(userfold( &folded, buf, sizeof(buf), user ) != RETURN_OK) return 0;
+   i = 0;
+   for(; i != LENGTH(IRC_PRIV); ++i)
+      if(IRC_CONN->acl[i].ok && banmatch( &IRC_CONN->acl[i].mask, &folded ))
+         acl |= 1u << i;
+   return acl;
+}
+
+static uint8_t acl_privs( uint32_t acl )
+{
+   uint8_t privs = 0;
+   size_t i;
+
+   i = 0;
+   for(; acl && i != LENGTH(IRC_PRIV); ++i)
+      if(acl & (1u << i)) privs |= IRC_CONN->acl[i].privs;
+   return privs;
+}
+
+/* cached on the nick until the identity changes or the ACL is reloaded */
+static uint8_t usrprivs( usr_t *u )
+{
+   nick_t *n = u->nick;
+
+   if(n->aclgen != IRC_CONN->aclgen)
+   {
+      n->acl    = acl_match( &u->user );
+      n->privs  = acl_privs( n->acl );
+      n->aclgen = IRC_CONN->aclgen;
+   }
+   return( u->user.privs = n->privs );
+}
+
+/* the sender's privileges into user->privs, from the record when there is one */
+static uint32_t useracl( user_info *user, usr_t *u )
+{
+   uint32_t acl;
+
+   if(u) { user->privs = usrprivs( u ); return u->nick->acl; }
+   acl = acl_match( user );
+   user->privs = acl_privs( acl );
+   return acl;
+}
+
+static int strsplit(char ***dst, const char *str, const char *token) {
+   char *saveptr, *ptr, *start;
+   int32_t t_len, i;
+   size_t len;
+
+   len=strlen(str);
+   t_len=strlen(token);
+
+   /* at most a piece per token plus the last, and the NULL */
+   if (!(saveptr=arena_alloc(&IRC_CONN->arena,len+1)) ||
+       !((*dst)=arena_alloc(&IRC_CONN->arena,(len/t_len+2)*sizeof(char*))))
+      return 0;
+   memcpy(saveptr,str,len+1);
+   i=0;
+
+   for (start=saveptr,ptr=start;;ptr++) {
+      if (!strncmp(ptr,token,t_len) || !*ptr) {
+         while (!strncmp(ptr,token,t_len)) {
+            *ptr=0;
+            ptr+=t_len;
+         }
+
+         (*dst)[i]=start;
+         (*dst)[i+1]=NULL;
+         i++;
+
+         if (!*ptr)
+            break;
+         start=ptr;
+      }
+   }
+   return i;
+}
+
+static uint64_t now_ms(void)
+{
+   struct timespec ts;
+   clock_gettime( CLOCK_MONOTONIC, &ts );
+   return( (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 );
+}
+
+static int evloop_init( evloop_t *loop )
+{
+   memset( loop, 0, sizeof(evloop_t) );
+   loop->timers = (pool_t)POOL_INIT( evtimer_t, 16 );
+   if((loop->epfd = epoll_create1( EPOLL_CLOEXEC )) == -1)
+      return( RETURN_FAIL );
+   return( RETURN_OK );
+}
+
+/* add or change what we wait for on w->fd */
+static int evloop_watch( evloop_t *loop, watch_t *w, uint32_t events )
+{
+   struct epoll_event ev;
+
+   if(w->added && w->events == events) return( RETURN_OK );
+
+   memset( &ev, 0, sizeof(ev) );
+   ev.events   = events;
+   ev.data.ptr = w;
+   if(epoll_ctl( loop->epfd, w->added ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, w->fd, &ev ) == -1)
+      return( RETURN_FAIL );
+
+   w->events = events;
+   w->added  = 1;
+   return( RETURN_OK );
+}
+
+static void evloop_unwatch( evloop_t *loop, watch_t *w )
+{
+   if(!w->added) return;
+   epoll_ctl( loop->epfd, EPOLL_CTL_DEL, w->fd, NULL );
+   w->added = 0;
+}
+
+static void timer_swap( evloop_t *loop, size_t a, size_t b )
+{
+   evtimer_t *t = loop->heap[a];
+   loop->heap[a] = loop->heap[b];
+   loop->heap[b] = t;
+   loop->heap[a]->slot = a;
+   loop->heap[b]->slot = b;
+}
+
+static void timer_up( evloop_t *loop, size_t i )
+{
+   for(; i && loop->heap[(i - 1) / 2]->when > loop->heap[i]->when; i = (i - 1) / 2)
+      timer_swap( loop, i, (i - 1) / 2 );
+}
+
+static void timer_down( evloop_t *loop, size_t i )
+{
+   size_t c;
+
+   for(; (c = i * 2 + 1) < loop->ntimers; i = c)
+   {
+      if(c + 1 < loop->ntimers && loop->heap[c + 1]->when < loop->heap[c]->when) ++c;
+      if(loop->heap[i]->when <= loop->heap[c]->when) break;
+      timer_swap( loop, i, c );
+   }
+}
+
+/* one shot, the timer is gone once it fired or got cancelled */
+static evtimer_t* evloop_timer( evloop_t *loop, uint64_t ms, timer_func *function, void *data )
+{
+   evtimer_t *t, **heap;
+
+   if(loop->ntimers == loop->cap)
+   {
+      if(!(heap = xrealloc( loop->heap, (loop->cap ? loop->cap * 2 : 16) * sizeof(evtimer_t*) )))
+         return NULL;
+      loop->heap = heap;
+      loop->cap  = loop->cap ? loop->cap * 2 : 16;
+   }
+   if(!(t = pool_alloc( &loop->timers ))) return NULL;
+
+   t->when     = now_ms() + ms;
+   t->function = function;
+   t->data     = data;
+   t->slot     = loop->ntimers;
+   loop->heap[ loop->ntimers++ ] = t;
+   timer_up( loop, t->slot );
+   return t;
+}
+
+static void timer_remove( evloop_t *loop, evtimer_t *t )
+{
+   size_t i = t->slot;
+
+   if(i != --loop->ntimers)
+   {
+      timer_swap( loop, i, loop->ntimers );
+      timer_down( loop, i );
+      timer_up( loop, i );
+   }
+   pool_free( &loop->timers, t );
+}
+
+static void evloop_cancel( evloop_t *loop, evtimer_t *t )
+{
+   if(t) timer_remove( loop, t );
+}
+
+static void evloop_run( evloop_t *loop )
+{
+   struct epoll_event events[ EVLOOP_EVENTS ];
+   timer_func *function;
+   evtimer_t *t;
+   watch_t *w;
+   uint64_t now;
+   void *data;
+   int i, n, timeout;
+
+   loop->running = 1;
+   if(loop->lock) pthread_mutex_lock( loop->lock );
+   while(loop->running)
+   {
+      if(loop->tick) loop->tick( loop->data );
+
+      timeout = -1;
+      if(loop->ntimers)
+      {
+         now = now_ms();
+         timeout = loop->heap[0]->when > now ? (int)(loop->heap[0]->when - now) : 0;
+      }
+
+      if(loop->lock) pthread_mutex_unlock( loop->lock );
+      n = epoll_wait( loop->epfd, events, EVLOOP_EVENTS, timeout );
+      if(loop->lock) pthread_mutex_lock( loop->lock );
+      if(n < 0 && errno != EINTR) break;
+
+      i = 0;
+      for(; i < n && loop->running; ++i)
+      {
+         w = events[i].data.ptr;
+         w->function( w, events[i].events );
+      }
+
+      now = now_ms();
+      while(loop->running && loop->ntimers && loop->heap[0]->when <= now)
+      {
+         t = loop->heap[0];
+         function = t->function; data = t->data;
+         timer_remove( loop, t );
+         function( data );
+      }
+   }
+   if(loop->lock) pthread_mutex_unlock( loop->lock );
+}
+
+static void evloop_free( evloop_t *loop )
+{
+   while(loop->ntimers) timer_remove( loop, loop->heap[0] );
+   pool_clear( &loop->timers );
+   xfree(loop->heap);
+   loop->heap = NULL;
+   loop->cap  = 0;
+   if(loop->epfd > 0) close(loop->epfd);
+   loop->epfd = -1;
+}
+
+static int sendtargetcmp( const void *value, const void *key )
+{
+   return( !strcmp(((const sendtarget_t*)value)->name, key) );
+}
+
+/* Formats one line straight into a queue node. Urgent and moderation
+ * lines go to their own FIFOs, bulk lines are queued per target. */
+static void sendq_printf( sendq_t *q, uint8_t prio, const char *target, const char *fmt, ... )
+{
+   va_list args;
+   sendline_t *l;
+   int len;
+
+   if(!(l = pool_alloc( &IRC_CONN->line_pool ))) return;
+
+   va_start( args, fmt );
+   len = vsnprintf( l->line, LINE_MAX - 1, fmt, args );
+   va_end( args );
+   if(len < 0) { pool_free( &IRC_CONN->line_pool, l ); return; }
+   if(len > LINE_MAX - 2) len = LINE_MAX - 2; /* truncated */
+   sendq_push( q, prio, target, l, len );
+}
+
+/* queue a line holding len bytes, CRLF is added */
+static void sendq_push( sendq_t *q, uint8_t prio, const char *target, sendline_t *l, size_t len )
+{
+   sendtarget_t *t;
+   uint32_t hash;
+
+   memcpy( l->line + len, "\r\n", 3 );
+   l->len    = len + 2;
+   l->next   = NULL;
+   l->queued = now_ms();
+
+   if(prio != PRIO_BULK || !target)
+   {
+      if(prio == PRIO_BULK) prio = PRIO_MODERATION;
+      if(q->tail[prio]) q->tail[prio]->next = l;
+      else q->head[prio] = l;
+      q->tail[prio] = l;
+      if(++q->depth > IRC_CONN->metrics.sendq_max) IRC_CONN->metrics.sendq_max = q->depth;
+      return;
+   }
+
+   hash = strhash( HASH_SEED, target );
+   if(!(t = hmap_get( &q->targets, hash, sendtargetcmp, target )))
+   {
+      if(strlen(target) >= IRC_CONN->target_pool.size - sizeof(sendtarget_t) ||
+         !(t = pool_alloc( &IRC_CONN->target_pool )))
+      { pool_free( &IRC_CONN->line_pool, l ); return; }
+      strcpy( t->name, target );
+      t->head = t->tail = NULL;
+      if(hmap_put( &q->targets, hash, t ) != RETURN_OK)
+      { pool_free( &IRC_CONN->target_pool, t ); pool_free( &IRC_CONN->line_pool, l ); return; }
+   }
+
+   if(!t->head)
+   {
+      /* target becomes active, join the round robin */
+      t->next = NULL;
+      if(q->last) q->last->next = t;
+      else q->first = t;
+      q->last = t;
+   }
+
+   if(t->tail) t->tail->next = l;
+   else t->head = l;
+   t->tail = l;
+   if(++q->depth > IRC_CONN->metrics.sendq_max) IRC_CONN->metrics.sendq_max = q->depth;
+}
+
+/* next line to send, one per target in turn for bulk traffic */
+static sendline_t* sendq_pop( sendq_t *q )
+{
+   sendline_t *l;
+   sendtarget_t *t;
+   uint8_t prio;
+
+   prio = 0;
+   for(; prio != PRIO_BULK; ++prio)
+   {
+      if(!(l = q->head[prio])) continue;
+      if(!(q->head[prio] = l->next)) q->tail[prio] = NULL;
+      q->depth--;
+      return l;
+   }
+
+   if(!(t = q->first)) return NULL;
+   if(!(q->first = t->next)) q->last = NULL;
+
+   l = t->head;
+   if(!(t->head = l->next)) t->tail = NULL;
+   q->depth--;
+
+   if(t->head)
+   {
+      t->next = NULL;
+      if(q->last) q->last->next = t;
+      else q->first = t;
+      q->last = t;
+   }
+   else {
+      hmap_del( &q->targets, strhash(HASH_SEED, t->name), sendtargetcmp, t->name );
+      pool_free( &IRC_CONN->target_pool, t );
+   }
+   return l;
+}
+
+/* drop bytes the socket took from the front of the batch */
+static void sendq_consume( sendq_t *q, size_t bytes )
+{
+   size_t i = 0, left;
+
+   for(; i != q->nbatch; ++i)
+   {
+      left = q->batch[i]->len - q->offset;
+      if(bytes < left) { q->offset += bytes; break; }
+      bytes    -= left;
+      q->offset = 0;
+      pool_free( &IRC_CONN->line_pool, q->batch[i] );
+   }
+
+   memmove( q->batch, q->batch + i, (q->nbatch - i) * sizeof(sendline_t*) );
+   q->nbatch -= i;
+}
+
+/* write the whole batch, fails when the socket is full */
+static int sendq_write( sendq_t *q, int fd )
+{
+   struct iovec iov[ SENDQ_IOV ];
+   struct msghdr mh;
+   ssize_t bytes;
+   size_t i;
+
+   while(q->nbatch)
+   {
+      for(i = 0; i != q->nbatch; ++i)
+      {
+         iov[i].iov_base = q->batch[i]->line + (i ? 0 : q->offset);
+         iov[i].iov_len  = q->batch[i]->len  - (i ? 0 : q->offset);
+      }
+      memset( &mh, 0, sizeof(mh) );
+      mh.msg_iov    = iov;
+      mh.msg_iovlen = q->nbatch;
+
+      if(IRC_CONN->capture)
+      {
+         for(i = 0; i != q->nbatch; ++i) capture( IRC_CONN->capture, iov[i].iov_base, iov[i].iov_len );
+         for(i = 0; i != q->nbatch; ++i) pool_free( &IRC_CONN->line_pool, q->batch[i] );
+         q->nbatch = q->offset = 0;
+         break;
+      }
+
+      bytes = sendmsg(fd, &mh, MSG_NOSIGNAL);
+      IRC_CONN->metrics.send_calls++;
+      if(bytes > 0) IRC_CONN->metrics.sent_bytes += bytes;
+      if(bytes < 0 && errno == EINTR) continue;
+      if(bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+      { q->blocked = 1; return( RETURN_FAIL ); }
+      if(bytes < 0) /* reader notices the dead socket */
+      {
+         for(i = 0; i != q->nbatch; ++i) pool_free( &IRC_CONN->line_pool, q->batch[i] );
+         q->nbatch = q->offset = 0;
+         break;
+      }
+      sendq_consume( q, bytes );
+   }
+
+   return( RETURN_OK );
+}
+
+/* Sends what the token bucket allows. Returns ms until the next line
+ * may go out, or -1 when the queue is empty or the socket is full. */
+static int sendq_flush( sendq_t *q, int fd )
+{
+   uint64_t now = now_ms();
+
+   q->budget += now - q->stamp;
+   if(q->budget > SENDQ_BURST * SENDQ_INTERVAL || q->unpaced) q->budget = SENDQ_BURST * SENDQ_INTERVAL;
+   q->stamp   = now;
+   q->blocked = 0;
+
+   if(q->nbatch && sendq_write( q, fd ) != RETURN_OK)
+      return -1;
+
+   while(q->depth)
+   {
+      /* everything the bucket allows goes out in one write */
+      while(q->depth && q->nbatch != SENDQ_IOV)
+      {
+         /* PONG does not wait for tokens, it still pays for them */
+         if(!q->head[ PRIO_URGENT ] && q->budget < SENDQ_INTERVAL) break;
+         if(!(q->batch[ q->nbatch ] = sendq_pop( q ))) break;
+         q->budget -= q->unpaced ? 0 : SENDQ_INTERVAL;
+         hist_add( &IRC_CONN->metrics.sendq_wait, (now - q->batch[ q->nbatch ]->queued) * 1000000 );
+         IRC_CONN->metrics.sent_lines++;
+#if DEBUG
+         printf("$ %.*s\n", (int)q->batch[ q->nbatch ]->len - 2, q->batch[ q->nbatch ]->line); /* without the CRLF */
+#endif
+         q->nbatch++;
+      }
+
+      if(!q->nbatch) return( q->budget < SENDQ_INTERVAL ? SENDQ_INTERVAL - q->budget : -1 );
+      if(sendq_write( q, fd ) != RETURN_OK) return -1;
+   }
+
+   return -1;
+}
+
+static void sendq_clear( sendq_t *q )
+{
+   sendline_t *l;
+
+   while((l = sendq_pop( q ))) pool_free( &IRC_CONN->line_pool, l );
+   while(q->nbatch) pool_free( &IRC_CONN->line_pool, q->batch[ --q->nbatch ] );
+   q->offset = 0;
+   hmap_clear( &q->targets );
+}
+
+/* Lines are kept contiguous so they can be handed out in place.
+ * Only the trailing partial line is ever moved, and only when the
+ * free space at the end runs low. */
+static char* recvbuf_space( recvbuf_t *rb, size_t *len )
+{
+   if(RECV_MAX - rb->tail < BUFFER_SIZE && rb->head)
+   {
+      memmove( rb->data, rb->data + rb->head, rb->tail - rb->head );
+      rb->tail -= rb->head;
+      rb->scan -= rb->head;
+      rb->head  = 0;
+   }
+
+   if(rb->tail == RECV_MAX)
+   {
+      /* no newline in a full buffer, drop it and resync on next line */
+      rb->head = rb->scan = rb->tail = 0;
+      rb->discard = 1;
+   }
+
+   *len = RECV_MAX - rb->tail;
+   return rb->data + rb->tail;
+}
+
+static ssize_t recvbuf_read( recvbuf_t *rb, int fd )
+{
+   ssize_t bytes;
+   size_t len;
+   char *space;
+
+   space = recvbuf_space( rb, &len );
+   bytes = recv(fd, space, len * sizeof(char), 0);
+   if(bytes > 0) rb->tail += bytes;
+   return( bytes );
+}
+
+static void recvbuf_drain( recvbuf_t *rb, line_func *func )
+{
+   char *line, *eol;
+   uint64_t start = 0;
+
+   line = rb->data + rb->head;
+   for(;;)
+   {
+      if(IRC_STATS) start = now_ns();
+      if(!(eol = memchr(rb->data + rb->scan, '\n', rb->tail - rb->scan))) break;
+      *eol = '\0';
+      if(eol != line && eol[-1] == '\r') eol[-1] = '\0';
+      rb->scan = eol - rb->data + 1;
+      if(IRC_STATS) hist_add( &IRC_CONN->hist[ STAGE_FRAME ], now_ns() - start );
+
+      if(rb->discard) rb->discard = 0;
+      else if(*line)
+      {
+#if DEBUG
+         printf("# %s\n", line);
+#endif
+         func( line );
+      }
+      line = eol + 1;
+   }
+
+   rb->head = line - rb->data;
+   rb->scan = rb->tail;
+   if(rb->head == rb->tail) rb->head = rb->scan = rb->tail = 0;
+}
+
+/* record from strings, 0 if it does not fit */
+static size_t store_pack( char *buf, uint16_t type, uint32_t flags, const char **str, size_t n )
+{
+   storerec_t rec;
+   size_t i, len, size = sizeof(storerec_t);
+
+   i = 0;
+   for(; i != n; ++i)
+   {
+      len = strlen(str[i]) + 1;
+      if(size + len > STORE_REC_MAX) return 0;
+      memcpy( buf + size, str[i], len );
+      size += len;
+   }
+   for(; size % 4; ++size) buf[size] = '\0';
+
+   rec.type = type; rec.size = size; rec.flags = flags;
+   memcpy( buf, &rec, sizeof(storerec_t) );
+   return size;
+}
+
+static int store_write( int fd, const char *buf, size_t len )
+{
+   ssize_t bytes;
+
+   while(len)
+   {
+      bytes = write(fd, buf, len);
+      if(bytes < 0 && errno == EINTR) continue;
+      if(bytes <= 0) return( RETURN_FAIL );
+      buf += bytes; len -= bytes;
+   }
+   return( RETURN_OK );
+}
+
+static size_t store_chanrec( char *buf, const chan_t *c )
+{
+   const char *str[1] = { c->name };
+   return store_pack( buf, STORE_CHAN, c->flags, str, 1 );
+}
+
+static size_t store_banrec( char *buf, const char *channel, const ban_t *b )
+{
+   const char *str[6] = { channel, b->text, b->reason, b->user.nick, b->user.ident, b->user.host };
+   return store_pack( buf, STORE_BAN, 0, str, 6 );
+}
+
+/* Child side of compaction. The fork is a consistent copy of the
+ * state, it is written out as a fresh snapshot and renamed over. */
+static int store_dump( const char *path )
+{
+   char buf[ STORE_REC_MAX ];
+   storehdr_t hdr = { STORE_MAGIC, STORE_VERSION };
+   FILE *f;
+   chan_t *c;
+   ban_t *b;
+   size_t i, j, len;
+   int fd, ok;
+
+   if((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600)) == -1) return( RETURN_FAIL );
+   if(!(f = fdopen(fd, "wb"))) { close(fd); return( RETURN_FAIL ); }
+   ok = (fwrite( &hdr, sizeof(hdr), 1, f ) == 1);
+
+   i = 0;
+   for(; ok && IRC_CONN->chans.slots && i != IRC_CONN->chans.mask + 1; ++i)
+   {
+      if(!(c = IRC_CONN->chans.slots[i].value)) continue;
+      if((len = store_chanrec( buf, c ))) ok = (fwrite( buf, len, 1, f ) == 1);
+
+      for(j = 0; ok && c->bans.index.slots && j != c->bans.index.mask + 1; ++j)
+         for(b = c->bans.index.slots[j].value; ok && b; b = b->next)
+            if((len = store_banrec( buf, c->name, b ))) ok = (fwrite( buf, len, 1, f ) == 1);
+      for(b = c->bans.glob; ok && b; b = b->next)
+         if((len = store_banrec( buf, c->name, b ))) ok = (fwrite( buf, len, 1, f ) == 1);
+   }
+
+   if(fflush(f) != 0 || fsync(fileno(f)) != 0) ok = 0;
+   if(fclose(f) != 0) ok = 0;
+   if(!ok || rename(path, IRC_CONN->store_db) != 0) { unlink(path); return( RETURN_FAIL ); }
+   return( RETURN_OK );
+}
+
+/* compaction child exited */
+static void store_done( watch_t *w, uint32_t events )
+{
+   int status = -1;
+
+   (void)events;
+   connenter( w->data );
+   waitpid( IRC_CONN->store_pid, &status, 0 );
+   evloop_unwatch( IRC_CONN->loop, w );
+   close(w->fd);
+   w->fd = -1;
+   IRC_CONN->store_pid = 0;
+
+   /* the snapshot has everything the old journal had */
+   if(WIFEXITED(status) && !WEXITSTATUS(status)) unlink(IRC_CONN->store_old);
+
+#if DEBUG
+   printf("$ STORE compacted (%d)\n", status);
+#endif
+}
+
+/* a new journal, with the header */
+static int store_journal(void)
+{
+   storehdr_t hdr = { STORE_MAGIC, STORE_VERSION };
+   struct stat st;
+
+   if((IRC_CONN->store = open(IRC_CONN->store_journal, O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0600)) == -1)
+      return( RETURN_FAIL );
+   if(fstat(IRC_CONN->store, &st) == 0 && st.st_size > 0)
+   { IRC_CONN->store_size = st.st_size; return( RETURN_OK ); }
+
+   IRC_CONN->store_size = sizeof(hdr);
+   return store_write( IRC_CONN->store, (const char*)&hdr, sizeof(hdr) );
+}
+
+/* Rotate the journal and let a child write the snapshot. Should the
+ * last compaction have failed its journal is still around, then this
+ * one keeps appending to the current journal instead of rotating. */
+static void store_compact(void)
+{
+   if(IRC_CONN->store_pid) return;
+
+   if(access(IRC_CONN->store_old, F_OK) != 0)
+   {
+      if(rename(IRC_CONN->store_journal, IRC_CONN->store_old) != 0) return;
+      close(IRC_CONN->store);
+      if(store_journal() != RETURN_OK) { IRC_CONN->store = -1; return; }
+   }
+
+   if((IRC_CONN->store_pid = fork()) == -1) { IRC_CONN->store_pid = 0; return; }
+   if(!IRC_CONN->store_pid) _exit( store_dump( IRC_CONN->store_tmp ) == RETURN_OK ? 0 : 1 );
+
+   IRC_CONN->store_proc.fd       = syscall( SYS_pidfd_open, IRC_CONN->store_pid, 0 );
+   IRC_CONN->store_proc.function = store_done;
+   IRC_CONN->store_proc.data     = IRC_CONN;
+   IRC_CONN->store_proc.added    = 0;
+   if(IRC_CONN->store_proc.fd == -1 || evloop_watch( IRC_CONN->loop, &IRC_CONN->store_proc, EPOLLIN ) != RETURN_OK)
+   {
+      /* nobody to tell us, wait for it here */
+      if(IRC_CONN->store_proc.fd != -1) close(IRC_CONN->store_proc.fd);
+      IRC_CONN->store_proc.fd = -1;
+      store_done( &IRC_CONN->store_proc, 0 );
+   }
+}
+
+/* write ahead, the change is on disk before we act on it */
+static void store_append( const char *buf, size_t len )
+{
+   if(IRC_CONN->store == -1 || !len) return;
+   if(store_write( IRC_CONN->store, buf, len ) != RETURN_OK) return;
+   if((IRC_CONN->store_size += len) >= STORE_COMPACT) store_compact();
+}
+
+static void store_chan( const chan_t *c )
+{
+   char buf[ STORE_REC_MAX ];
+   if(IRC_CONN->store == -1) return;
+   store_append( buf, store_chanrec( buf, c ) );
+}
+
+static void store_ban( const char *channel, const ban_t *b )
+{
+   char buf[ STORE_REC_MAX ];
+   if(IRC_CONN->store == -1) return;
+   store_append( buf, store_banrec( buf, channel, b ) );
+}
+
+static void store_unban( const char *channel, const ban_t *b )
+{
+   char buf[ STORE_REC_MAX ];
+   const char *str[2] = { channel, b->text };
+   if(IRC_CONN->store == -1) return;
+   store_append( buf, store_pack( buf, STORE_UNBAN, 0, str, 2 ) );
+}
+
+/* next string of a record, NULL when it would run past the end */
+static const char* store_str( const char **p, const char *end )
+{
+   const char *s = *p, *nul;
+
+   if(s >= end || !(nul = memchr(s, '\0', end - s))) return NULL;
+   *p = nul + 1;
+   return s;
+}
+
+static void store_apply( const storerec_t *rec, const char *end )
+{
+   const char *p = (const char*)(rec + 1), *channel, *mask, *reason;
+   user_info victim;
+   chan_t *c;
+   ban_t *b;
+
+   if(!(channel = store_str( &p, end ))) return;
+   if(rec->type == STORE_CHAN)
+   {
+      if((c = addchan( channel, rec->flags ))) c->flags = rec->flags;
+      return;
+   }
+
+   if(!(mask = store_str( &p, end ))) return;
+   if(!(c = addchan( channel, CHAN_WELCOME | CHAN_AUTOOP ))) return;
+
+   if(rec->type == STORE_UNBAN)
+   {
+      if((b = banlist_mask( &c->bans, mask ))) banlist_del( &c->bans, b );
+      return;
+   }
+
+   if(rec->type != STORE_BAN || banlist_mask( &c->bans, mask )) return;
+   if(!(reason = store_str( &p, end )) ||
+      !(victim.nick = store_str( &p, end )) ||
+      !(victim.ident = store_str( &p, end )) ||
+      !(victim.host = store_str( &p, end ))) return;
+   victim.channel = c->name;
+   victim.privs   = 0;
+   victim.nkey    = victim.ckey = NULL;
+   banlist_add( &c->bans, mask, victim.nick[0] ? &victim : NULL, reason );
+}
+
+/* map a snapshot or journal and apply its records in order */
+static size_t store_load( const char *path )
+{
+   const storehdr_t *hdr;
+   const storerec_t *rec;
+   struct stat st;
+   const char *map, *p, *end;
+   size_t count = 0;
+   int fd;
+
+   if((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) return 0;
+   if(fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(storehdr_t))
+   { close(fd); return 0; }
+
+   map = mmap( NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0 );
+   close(fd);
+   if(map == MAP_FAILED) return 0;
+   madvise( (void*)map, st.st_size, MADV_SEQUENTIAL );
+
+   hdr = (const storehdr_t*)map;
+   end = map + st.st_size;
+   if(hdr->magic == STORE_MAGIC && hdr->version == STORE_VERSION)
+   {
+      /* a torn record at the end of a journal is dropped */
+      for(p = map + sizeof(storehdr_t); p + sizeof(storerec_t) <= end; p += rec->size, ++count)
+      {
+         rec = (const storerec_t*)p;
+         if(rec->size < sizeof(storerec_t) || rec->size % 4 || p + rec->size > end) break;
+         store_apply( rec, p + rec->size );
+      }
+   }
+   else printf("-!- %s: not a store, ignored\n", path);
+
+   munmap( (void*)map, st.st_size );
+   return count;
+}
+
+/* snapshot, then journals in the order they were written */
+static void store_open(void)
+{
+   ircconn_t *c = IRC_CONN;
+   size_t count;
+
+   /* a cut path would load and compact some other file */
+   if((size_t)snprintf( c->store_db, STORE_PATH_MAX, BOT_STORE, c->net->name ) >= STORE_PATH_MAX ||
+      (size_t)snprintf( c->store_journal, STORE_PATH_MAX, "%s"STORE_JOURNAL, c->store_db ) >= STORE_PATH_MAX ||
+      (size_t)snprintf( c->store_old, STORE_PATH_MAX, "%s"STORE_OLD, c->store_db ) >= STORE_PATH_MAX ||
+      (size_t)snprintf( c->store_tmp, STORE_PATH_MAX, "%s"STORE_TMP, c->store_db ) >= STORE_PATH_MAX)
+   { printf("-!- %s: store path too long, bans are not kept\n", c->net->name); c->store = -1; return; }
+
+   count  = store_load( c->store_db );
+   count += store_load( c->store_old );
+   count += store_load( c->store_journal );
+   if(count) printf("-!- %s: Loaded %zu stored records\n", c->net->name, count);
+
+   if(store_journal() != RETURN_OK)
+   { printf("-!- Cannot open %s, bans are not kept\n", c->store_journal); c->store = -1; }
+   else if(c->store_size >= STORE_COMPACT) store_compact();
+}
+
+static void store_close(void)
+{
+   /* a snapshot half written is useless, let it finish */
+   if(IRC_CONN->store_pid) { waitpid( IRC_CONN->store_pid, NULL, 0 ); IRC_CONN->store_pid = 0; }
+   if(IRC_CONN->store_proc.fd > 0) close(IRC_CONN->store_proc.fd);
+   IRC_CONN->store_proc.fd = -1;
+   if(IRC_CONN->store != -1) close(IRC_CONN->store);
+   IRC_CONN->store = -1;
+}
+
+/* runs on its own thread, the loop learns through c->resolved */
+static void* resolver( void *data )
+{
+   ircconn_t *c = data;
+   struct addrinfo hints;
+   char port[ 16 ];
+   uint64_t one = 1;
+
+   memset( &hints, 0, sizeof(hints) );
+   hints.ai_family   = AF_UNSPEC;
+   hints.ai_socktype = SOCK_STREAM;
+   hints.ai_flags    = AI_ADDRCONFIG;
+   snprintf( port, sizeof(port), "%d", c->net->port );
+   c->gai = getaddrinfo( c->net->server, port, &hints, &c->addrs );
+   if(write(c->resolved.fd, &one, sizeof(one)) < 0) {}
+   return NULL;
+}
+
+/* alternate families, keeping the resolver's order within each */
+static struct addrinfo* addrmix( struct addrinfo *ai )
+{
+   struct addrinfo *same = NULL, *other = NULL, **st = &same, **ot = &other, *head = NULL, **t = &head;
+   int family = ai ? ai->ai_family : 0;
+
+   for(; ai; ai = ai->ai_next)
+   {
+      if(ai->ai_family == family) { *st = ai; st = &ai->ai_next; }
+      else { *ot = ai; ot = &ai->ai_next; }
+   }
+   *st = *ot = NULL;
+
+   while(same || other)
+   {
+      if(same)  { *t = same;  t = &same->ai_next;  same  = same->ai_next; }
+      if(other) { *t = other; t = &other->ai_next; other = other->ai_next; }
+   }
+   *t = NULL;
+   return head;
+}
+
+/* all addresses failed or the deadline passed */
+static void dialfail( ircconn_t *c, const char *why )
+{
+   printf("-!- %s: Connection failed (%s)\n", c->net->name, why);
+   connclose( c );
+}
+
+static void dialtimeout( void *data )
+{
+   ircconn_t *c = connenter( data );
+
+   c->deadline = NULL;
+   dialfail( c, "timed out" );
+}
+
+static void dialstagger( void *data )
+{
+   ircconn_t *c = connenter( data );
+
+   c->stagger = NULL;
+   dialnext( c );
+}
+
+/* first connect to complete wins, the others are dropped */
+static void dialdone( watch_t *w, uint32_t events )
+{
+   ircconn_t *c = connenter( w->data );
+   char ip[ INET6_ADDRSTRLEN ];
+   struct sockaddr_storage sa;
+   socklen_t len = sizeof(int);
+   int err = 0, fd = w->fd;
+
+   /* a sibling won earlier in the same epoll batch and closed this one */
+   if(fd == -1 || c->state != CONN_CONNECTING) return;
+   if(getsockopt( fd, SOL_SOCKET, SO_ERROR, &err, &len ) != 0) err = errno;
+   if(!err && (events & (EPOLLERR | EPOLLHUP))) err = ECONNREFUSED;
+   if(err == EINPROGRESS) return;
+
+   evloop_unwatch( c->loop, w );
+   w->fd = -1;
+   if(err)
+   {
+      close(fd);
+      evloop_cancel( c->loop, c->stagger ); /* a failure starts the next one right away */
+      c->stagger = NULL;
+      dialnext( c );
+      return;
+   }
+
+   dialclear( c );
+   c->socket = fd;
+   len = sizeof(sa);
+   if(getpeername( fd, (struct sockaddr*)&sa, &len ) != 0 ||
+      getnameinfo( (struct sockaddr*)&sa, len, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST ) != 0)
+      strcpy( ip, "?" );
+   printf("-!- %s: Connected to %s (%s), sending nick\n", c->net->name, c->net->server, ip);
+
+   if(connup( c ) != RETURN_OK) { connclose( c ); return; }
+   sendq_printf( &c->sendq, PRIO_URGENT, NULL, "NICK %s", c->net->nick );
+   sendq_printf( &c->sendq, PRIO_URGENT, NULL, "USER %s \"\" \"%s\" :x", c->net->nick, ip );
+}
+
+/* start a connect to the next address, CONNECT_STAGGER apart */
+static void dialnext( ircconn_t *c )
+{
+   struct addrinfo *ai;
+   char ip[ INET6_ADDRSTRLEN ];
+   size_t i, busy;
+   watch_t *w;
+   int fd;
+
+   for(busy = 0, w = NULL, i = 0; i != CONNECT_MAX; ++i)
+   {
+      if(c->dial[i].fd != -1) busy++;
+      else if(!w) w = &c->dial[i];
+   }
+
+   while(w && (ai = c->nextaddr))
+   {
+      c->nextaddr = ai->ai_next;
+      if(getnameinfo( ai->ai_addr, ai->ai_addrlen, ip, sizeof(ip), NULL, 0, NI_NUMERICHOST ) != 0)
+         strcpy( ip, "?" );
+      printf("-!- %s: Connecting to %s (%s) port %d\n", c->net->name, c->net->server, ip, c->net->port);
+
+      if((fd = socket( ai->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0 )) == -1) continue;
+      if(connect( fd, ai->ai_addr, ai->ai_addrlen ) != 0 && errno != EINPROGRESS)
+      { close(fd); continue; }
+
+      w->fd       = fd;
+      w->function = dialdone;
+      w->data     = c;
+      if(evloop_watch( c->loop, w, EPOLLOUT ) != RETURN_OK)
+      { close(fd); w->fd = -1; continue; }
+
+      if(c->nextaddr && !c->stagger) c->stagger = evloop_timer( c->loop, CONNECT_STAGGER, dialstagger, c );
+      return;
+   }
+
+   if(!busy && !c->nextaddr) dialfail( c, "no address answered" );
+}
+
+/* drop connects still in flight and what is left to try */
+static void dialclear( ircconn_t *c )
+{
+   size_t i;
+
+   i = 0;
+   for(; i != CONNECT_MAX; ++i)
+   {
+      if(c->dial[i].fd == -1) continue;
+      evloop_unwatch( c->loop, &c->dial[i] );
+      close(c->dial[i].fd);
+      c->dial[i].fd = -1;
+   }
+   evloop_cancel( c->loop, c->stagger );
+   evloop_cancel( c->loop, c->deadline );
+   c->stagger = c->deadline = NULL;
+   if(c->resolving) return; /* addrs belong to the resolver until connresolved */
+   if(c->addrs) freeaddrinfo( c->addrs );
+   c->addrs = c->nextaddr = NULL;
+}
+
+/* the resolver is done, start dialing */
+static void connresolved( watch_t *w, uint32_t events )
+{
+   ircconn_t *c = connenter( w->data );
+   uint64_t n;
+
+   (void)events;
+   if(read(w->fd, &n, sizeof(n)) < 0) return;
+   pthread_join( c->resolver, NULL );
+   c->resolving = 0;
+
+   /* timed out meanwhile, the next attempt resolves again */
+   if(c->state != CONN_CONNECTING)
+   {
+      if(c->gai == 0) freeaddrinfo( c->addrs );
+      c->addrs = NULL;
+      return;
+   }
+
+   if(c->gai != 0)
+   {
+      c->addrs = NULL;
+      printf("-!- %s: Invalid server (%s)\n", c->net->name, gai_strerror(c->gai));
+      connclose( c );
+      return;
+   }
+
+   c->addrs = c->nextaddr = addrmix( c->addrs );
+   dialnext( c );
+}
+
+/* Nothing here blocks, connresolved and dialdone carry on.
+ * CONNECT_TIMEOUT covers the lookup too, getaddrinfo can hang. */
+static int ircconnect( ircconn_t *c )
+{
+   c->state = CONN_CONNECTING;
+   if(!c->resolved.added && evloop_watch( c->loop, &c->resolved, EPOLLIN ) != RETURN_OK)
+      return( RETURN_FAIL );
+   if(!(c->deadline = evloop_timer( c->loop, CONNECT_TIMEOUT, dialtimeout, c )))
+      return( RETURN_FAIL );
+   if(c->resolving) return( RETURN_OK ); /* a lookup that timed out is still running, use it */
+   if(pthread_create( &c->resolver, NULL, resolver, c ) != 0)
+      return( RETURN_FAIL );
+   c->resolving = 1;
+   return( RETURN_OK );
+}
+
+/* Splits line in place into prefix, command and params in one pass.
+ * [@tags] [:nick[!ident][@host]] command [params...] [:trailing] */
+static int ircparse( ircmsg_t *msg, char *line )
+{
+   char *p = line;
+
+   msg->nick = msg->ident = msg->host = NULL;
+   msg->nparams = 0;
+
+   /* skip IRCv3 tags */
+   if(*p == '@')
+   {
+      for(; *p && *p != ' '; ++p);
+      for(; *p == ' '; ++p);
+   }
+
+   /* prefix */
+   if(*p == ':')
+   {
+      msg->nick = ++p;
+      for(; *p && *p != ' '; ++p)
+      {
+         if(*p == '!' && !msg->ident && !msg->host) { *p = '\0'; msg->ident = p + 1; }
+         else if(*p == '@' && !msg->host)          { *p = '\0'; msg->host  = p + 1; }
+      }
+      if(!*p) return( RETURN_FAIL ); /* no command */
+      for(*p++ = '\0'; *p == ' '; ++p);
+   }
+
+   /* command */
+   msg->command = p;
+   for(; *p && *p != ' '; ++p);
+   if(p == msg->command) return( RETURN_FAIL );
+
+   /* params */
+   while(*p)
+   {
+      for(*p++ = '\0'; *p == ' '; ++p);
+      if(!*p) break;
+
+      if(*p == ':' || msg->nparams == IRC_PARAMS_MAX - 1)
+      {
+         msg->params[ msg->nparams++ ] = p + (*p == ':');
+         break;
+      }
+
+      msg->params[ msg->nparams++ ] = p;
+      for(; *p && *p != ' '; ++p);
+   }
+
+   return( RETURN_OK );
+}
+
+/* fill user from message source, first param is the target */
+static int msgtouser( user_info *user, const ircmsg_t *msg )
+{
+   const char *ident;
+
+   if(!msg->nick || !msg->ident || !msg->host || !msg->nparams)
+      return( RETURN_FAIL );
+
+   ident = msg->ident;
+   for(; *ident == '~'; ++ident);
+
+   /* non valid */
+   if(strlen(msg->nick) > IRC_CONN->isupport.nicklen) return( RETURN_FAIL );
+   if(strlen(ident) > IRC_CONN->isupport.userlen)     return( RETURN_FAIL );
+   if(strlen(msg->host) > IRC_CONN->isupport.hostlen) return( RETURN_FAIL );
+
+   user->nick  = msg->nick;
+   user->ident = ident;
+   user->host  = msg->host;
+   user->privs = 0;
+
+   /* folded once here, the lookups of the handlers use the keys */
+   casekey( &IRC_CONN->fromnick, IRC_CONN->fromnickkey, KEY_MAX, msg->nick );
+   casekey( &IRC_CONN->fromchan, IRC_CONN->fromchankey, KEY_MAX, msg->params[0] );
+   user->nkey = &IRC_CONN->fromnick;
+   user->ckey = &IRC_CONN->fromchan;
+
+   if(keyeq( user->ckey, &IRC_CONN->me ))
+   { user->channel = user->nick; user->ckey = user->nkey; } /* PRIVATE MESSAGE */
+   else user->channel = msg->params[0];
+
+   return( RETURN_OK );
+}
+
+static int chancmp( const void *value, const void *key )
+{
+   return keyeq( &((const chan_t*)value)->key, key );
+}
+
+static chan_t* chanfind( const casekey_t *k )
+{
+   return hmap_get( &IRC_CONN->chans, k->hash, chancmp, k );
+}
+
+static chan_t* getchan( const char *name )
+{
+   char buf[ KEY_MAX ];
+   casekey_t k;
+
+   casekey( &k, buf, sizeof(buf), name );
+   return chanfind( &k );
+}
+
+/* the channel the user said something in */
+static chan_t* userchan( const user_info *user )
+{
+   char buf[ KEY_MAX ];
+   casekey_t k;
+
+   return chanfind( chankey( user, &k, buf ) );
+}
+
+static chan_t* addchan( const char *name, uint32_t flags )
+{
+   size_t len = strlen(name);
+   chan_t *c;
+
+   if((c = getchan( name ))) return c;
+   if(!ischannel(name) || len > IRC_CONN->isupport.channellen) return NULL;
+   if(!(c = pool_alloc( &IRC_CONN->chan_pool ))) return NULL;
+
+   memset( c, 0, sizeof(chan_t) );
+   if(!(c->name = xmalloc( len * 2 + 2 ))) { pool_free( &IRC_CONN->chan_pool, c ); return NULL; }
+   memcpy( c->name, name, len + 1 );
+   casekey( &c->key, c->name + len + 1, len + 1, name );
+   c->flags = flags;
+   if(hmap_put( &IRC_CONN->chans, c->key.hash, c ) != RETURN_OK)
+   { xfree(c->name); pool_free( &IRC_CONN->chan_pool, c ); return NULL; }
+   return c;
+}
+
+/* take a channel back out of a batch not flushed yet */
+static int unbatch( chan_t **batch, chan_t *c )
+{
+   for(; *batch; batch = &(*batch)->batch)
+   {
+      if(*batch != c) continue;
+      *batch = c->batch;
+      c->batch = NULL;
+      return( RETURN_OK );
+   }
+   return( RETURN_FAIL );
+}
+
+/* queued and sent as JOIN #a,#b,... from ircflush */
+static void joinchannel( const char *channel )
+{
+   chan_t *c;
+
+   if(!(c = addchan( channel, CHAN_WELCOME | CHAN_AUTOOP ))) return;
+   if(!(c->flags & CHAN_AUTOJOIN)) { c->flags |= CHAN_AUTOJOIN; store_chan( c ); }
+   if(c->state == CHAN_JOINED || c->state == CHAN_JOINING) return;
+
+   /* PART not sent yet, just stay */
+   if(c->state == CHAN_PARTING && unbatch( &IRC_CONN->parts, c ) == RETURN_OK)
+   { c->state = CHAN_JOINED; return; }
+
+   c->state = CHAN_JOINING;
+   c->batch = IRC_CONN->joins;
+   IRC_CONN->joins = c;
+}
+
+static void partchannel( const char *channel )
+{
+   chan_t *c;
+
+   if(!(c = getchan( channel ))) return;
+   if(c->flags & CHAN_AUTOJOIN) { c->flags &= ~CHAN_AUTOJOIN; store_chan( c ); }
+
+   /* JOIN not sent yet, never go */
+   if(c->state == CHAN_JOINING && unbatch( &IRC_CONN->joins, c ) == RETURN_OK)
+   { c->state = CHAN_PARTED; return; }
+   if(c->state != CHAN_JOINED) return;
+
+   c->state = CHAN_PARTING;
+   c->batch = IRC_CONN->parts;
+   IRC_CONN->parts = c;
+}
+
+/* join whatever should be joined and is not */
+static void joinall(void)
+{
+   chan_t *c;
+   size_t i;
+
+   i = 0;
+   for(; IRC_CONN->chans.slots && i != IRC_CONN->chans.mask + 1; ++i)
+   {
+      if(!(c = IRC_CONN->chans.slots[i].value)) continue;
+      if((c->flags & CHAN_AUTOJOIN) && c->state == CHAN_PARTED) joinchannel( c->name );
+   }
+}
+
+/* send a batch as few comma separated lines */
+static void chanflush( chan_t **batch, const char *command, size_t max )
+{
+   char line[ LINE_MAX ];
+   size_t len, n, count;
+   chan_t *c;
+
+   len = count = 0;
+   while((c = *batch))
+   {
+      *batch = c->batch;
+      c->batch = NULL;
+      n = strlen(c->name);
+      if(len && (len + 1 + n > LINE_MAX - 2 - strlen(command) - 1 || count == max))
+      { sendq_printf( &IRC_CONN->sendq, PRIO_MODERATION, NULL, "%s %.*s", command, (int)len, line ); len = count = 0; }
+      if(len) line[len++] = ',';
+      memcpy( line + len, c->name, n );
+      len += n;
+      count++;
+   }
+   if(len) sendq_printf( &IRC_CONN->sendq, PRIO_MODERATION, NULL, "%s %.*s", command, (int)len, line );
+}
+
+/* everything batched while handling input, before the send queue */
+static void batchflush(void)
+{
+   chanflush( &IRC_CONN->joins, HEADER_JOIN, IRC_CONN->isupport.maxjoin );
+   chanflush( &IRC_CONN->parts, HEADER_PART, IRC_CONN->isupport.maxpart );
+   modeflush();
+}
+
+static void ping( const ircmsg_t *msg )
+{
+   sendq_printf( &IRC_CONN->sendq, PRIO_URGENT, NULL, HEADER_PONG" :%s", msg->nparams ? msg->params[0] : "" );
+   joinall();
+}
+
+/* the nick we got might not be the one asked for */
+static void setme( const char *nick )
+{
+   snprintf( IRC_CONN->menick, sizeof(IRC_CONN->menick), "%s", nick );
+   casekey( &IRC_CONN->me, IRC_CONN->mekey, KEY_MAX, IRC_CONN->menick );
+}
+
+/* registered, the backoff starts over */
+static void welcome( const ircmsg_t *msg )
+{
+   if(msg->nparams) setme( msg->params[0] );
+   if(IRC_CONN->retries) printf("-!- %s: Registered after %u retries\n", IRC_CONN->net->name, IRC_CONN->retries);
+   IRC_CONN->retries = 0;
+}
+
+static int cmdcmp( const void *value, const void *key )
+{
+   const command_t *c = value;
+   const cmdkey_t  *k = key;
+   return( !strncmp(c->command, k->word, k->len) && !c->command[ k->len ] );
+}
+
+static int cmd_init(void)
+{
+   size_t i;
+
+   i = 0;
+   for(; i != LENGTH(MSG_CMD); ++i)
+   {
+      if(hmap_put( &IRC_CMD, strhash(HASH_SEED, MSG_CMD[i].command), (void*)&MSG_CMD[i] ) != RETURN_OK)
+         return( RETURN_FAIL );
+      IRC_CMD_FIRST[ (uint8_t)MSG_CMD[i].command[0] / 8 ] |= 1 << ((uint8_t)MSG_CMD[i].command[0] % 8);
+   }
+   return( RETURN_OK );
+}
+
+/* exact match on the first word, hashed while looking for its end */
+static void privmsg( const user_info *user, const char *message )
+{
+   const command_t *c;
+   const char *p;
+   uint32_t hash;
+   cmdkey_t key;
+
+   /* plain chat */
+   if(!(IRC_CMD_FIRST[ (uint8_t)message[0] / 8 ] & (1 << ((uint8_t)message[0] % 8))))
+      return;
+
+   hash = HASH_SEED;
+   for(p = message; *p && *p != ' '; ++p)
+      hash = (hash ^ (uint8_t)*p) * 16777619u;
+
+   key.word = message; key.len = p - message;
+   if(!(c = hmap_get( &IRC_CMD, hash, cmdcmp, &key )))
+      return;
+   if(flood( user, FLOOD_COMMAND ) != RETURN_OK)
+      return;
+
+   c->function( user, *p ? p + 1 : "" );
+}
+
+static void parsemessage( const ircmsg_t *msg )
+{
+   user_info user;
+
+   if(msg->nparams < 2) return; /* non valid */
+   if(msgtouser( &user, msg ) != RETURN_OK) return;
+
+   useracl( &user, addusr( &user ) ); /* learns the host of users loaded from NAMES */
+   if(flood( &user, FLOOD_LINE ) != RETURN_OK) return;
+   privmsg( &user, msg->params[1] );
+}
+
+/* the first IRC_PRIV entry matching runs */
+static void joinhandle( const user_info *user, uint32_t acl )
+{
+   size_t i;
+
+   i = 0;
+   for(; acl && i != LENGTH(IRC_PRIV); ++i)
+   {
+      if(!(acl & (1u << i))) continue;
+      if(IRC_PRIV[i].joinfunc) IRC_PRIV[i].joinfunc( user );
+      if(IRC_PRIV[i].priv) set_mode( user, IRC_PRIV[i].priv );
+      return;
+   }
+}
+
+static void parthandle( const user_info *user, uint32_t acl )
+{
+   size_t i;
+
+   i = 0;
+   for(; acl && i != LENGTH(IRC_PRIV); ++i)
+   {
+      if(!(acl & (1u << i))) continue;
+      if(IRC_PRIV[i].partfunc) IRC_PRIV[i].partfunc( user );
+      return;
+   }
+}
+
+static void parsejoin( const ircmsg_t *msg )
+{
+   user_info user;
+   uint32_t acl;
+   chan_t *c;
+
+   if(msgtouser( &user, msg ) != RETURN_OK) return;
+   if(keyeq( user.nkey, &IRC_CONN->me ))
+   {
+      if(!(c = addchan( user.channel, CHAN_WELCOME | CHAN_AUTOOP ))) return;
+      c->state = CHAN_JOINED;
+      printf("-!- Joined %s\n", user.channel);
+      return;
+   }
+   acl = useracl( &user, addusr( &user ) );
+   if(flood( &user, FLOOD_JOIN ) != RETURN_OK) return;
+   joinhandle( &user, acl );
+   JOIN( &user );
+}
+
+static void parsepart( const ircmsg_t *msg )
+{
+   user_info user;
+   uint32_t acl;
+   chan_t *c;
+   int flooded;
+
+   if(msgtouser( &user, msg ) != RETURN_OK) return;
+   if(keyeq( user.nkey, &IRC_CONN->me ))
+   {
+      if((c = userchan( &user ))) { c->state = CHAN_PARTED; modeclear( c ); }
+      printf("-!- Parted %s\n", user.channel);
+      unusr_channel( user.channel );
+      return;
+   }
+   acl = useracl( &user, findusr( &user ) );
+   flooded = flood( &user, FLOOD_JOIN ); /* reads the record for ops */
+   unusr( &user );
+   if(flooded != RETURN_OK) return;
+   parthandle( &user, acl );
+   PART( &user );
+}
+
+/* :kicker!ident@host KICK <channel> <nick> :reason, the kicked one leaves */
+static void parsekick( const ircmsg_t *msg )
+{
+   char buf[ KEY_MAX ], store[ LINE_MAX ];
+   user_info user;
+   casekey_t k;
+   uint32_t acl;
+   chan_t *c;
+   usr_t *u;
+
+   if(msg->nparams < 2 || !(c = getchan( msg->params[0] ))) return;
+   if(isme( msg->params[1] ))
+   {
+      c->state = CHAN_PARTED;
+      modeclear( c );
+      printf("-!- Kicked from %s\n", c->name);
+      unusr_channel( c->name );
+      return;
+   }
+
+   casekey( &k, buf, sizeof(buf), msg->params[1] );
+   if(!(u = usrfind( c, &k ))) return;
+   acl = useracl( &u->user, u );
+   if(userpack( &user, store, sizeof(store), &u->user ) != RETURN_OK) return;
+   delusr( u );
+   parthandle( &user, acl );
+}
+
+/* :old!ident@host NICK :new, the nick is rekeyed once and every
+ * channel it is on sees the new name */
+static void parsenick( const ircmsg_t *msg )
+{
+   char buf[ KEY_MAX ];
+   const char *ident, *host;
+   casekey_t k;
+   nick_t *n, *stale;
+   usr_t *u;
+
+   if(!msg->nick || !msg->nparams || !*msg->params[0]) return;
+   if(isme( msg->nick )) { setme( msg->params[0] ); return; }
+
+   casekey( &k, buf, sizeof(buf), msg->nick );
+   if(!(n = nickfind( &k ))) return;
+   hmap_del( &IRC_CONN->nicks, n->key.hash, nickcmp, &n->key );
+
+   /* whoever held the name before left without us noticing */
+   casekey( &k, buf, sizeof(buf), msg->params[0] );
+   if((stale = nickfind( &k ))) dropnick( stale );
+
+   ident = n->ident; host = n->host;
+   if(!*host && msg->ident && msg->host)
+   { for(ident = msg->ident; *ident == '~'; ++ident); host = msg->host; }
+   if(strlen(msg->params[0]) > IRC_CONN->isupport.nicklen ||
+      nickpack( n, msg->params[0], ident, host ) != RETURN_OK ||
+      hmap_put( &IRC_CONN->nicks, n->key.hash, n ) != RETURN_OK)
+   { dropnick( n ); return; }
+
+#if DEBUG
+   printf( "$ NICK %s -> %s (%zu channels)\n", msg->nick, n->nick, n->nchans );
+#endif
+
+   /* the new name might be banned or privileged */
+   for(u = n->chans; u; u = u->cnext)
+   {
+      if(banlist_find( &u->chan->bans, &u->user )) kick_reply( &u->user, REPLY_BANNED, NULL );
+      autoop( u );
+   }
+}
+
+/* :nick!ident@host QUIT :reason, gone from every channel we share */
+static void parsequit( const ircmsg_t *msg )
+{
+   char buf[ KEY_MAX ];
+   casekey_t k;
+   nick_t *n;
+
+   if(!msg->nick || isme( msg->nick )) return;
+   casekey( &k, buf, sizeof(buf), msg->nick );
+   if(!(n = nickfind( &k ))) return;
+
+#if DEBUG
+   printf( "$ QUIT %s (%zu channels)\n", n->nick, n->nchans );
+#endif
+   dropnick( n );
+}
+
+/* keep member prefix modes in sync */
+static void chanmode( chan_t *c, const ircmsg_t *msg )
+{
+   char buf[ KEY_MAX ];
+   const char *m;
+   size_t arg = 2;
+   int set = 1;
+   uint8_t flag;
+   casekey_t k;
+   usr_t *u;
+
+   for(m = msg->params[1]; *m; ++m)
+   {
+      if(*m == '+' || *m == '-') { set = (*m == '+'); continue; }
+      if(!modeparam( *m, set )) continue;
+      if(arg >= msg->nparams) return;
+
+      casekey( &k, buf, sizeof(buf), msg->params[arg++] );
+      if(!strchr(IRC_CONN->isupport.prefixmodes, *m) || !(flag = modeflag( *m ))) continue;
+      if(!(u = usrfind( c, &k ))) continue;
+      if(set) u->modes |= flag;
+      else u->modes &= ~flag;
+   }
+}
+
+/* MODE SET FOR <NICK> or channel */
+static void parsemode( const ircmsg_t *msg )
+{
+   chan_t *c;
+
+   if(msg->nparams >= 2 && (c = getchan( msg->params[0] )))
+   { chanmode( c, msg ); return; }
+
+   if(!msg->nick || !isme( msg->nick )) return;
+   if(!msg->nparams || !isme( msg->params[0] )) return;
+   joinall();
+}
+
+/* 353 <me> <symbol> <channel> :<names> */
+static void parsenames( const ircmsg_t *msg )
+{
+   chan_t *c;
+
+   if(msg->nparams < 4 || !(c = getchan( msg->params[2] ))) return;
+   stagenames( c, msg->params[3] );
+}
+
+/* 366 <me> <channel> :End of /NAMES list. */
+static void parsenamesend( const ircmsg_t *msg )
+{
+   chan_t *c;
+
+   if(msg->nparams < 2 || !(c = getchan( msg->params[1] ))) return;
+   loadnames( c );
+}
+
+/* could not join, try again on next PING */
+static void parsejoinerr( const ircmsg_t *msg )
+{
+   chan_t *c;
+
+   if(msg->nparams < 2 || !(c = getchan( msg->params[1] ))) return;
+   if(c->state == CHAN_JOINING) c->state = CHAN_PARTED;
+   printf("-!- Cannot join %s: %s\n", c->name, msg->params[ msg->nparams - 1 ]);
+}
+
+/* PREFIX=(qaohv)~&@%+ */
+static void isupport_prefix( const char *value )
+{
+   const char *close;
+   size_t n;
+
+   if(*value != '(' || !(close = strchr(value, ')'))) return;
+   n = close - value - 1;
+   if(n >= sizeof(IRC_CONN->isupport.prefixes) || strlen(close + 1) != n) return;
+   memcpy( IRC_CONN->isupport.prefixmodes, value + 1, n );
+   IRC_CONN->isupport.prefixmodes[n] = '\0';
+   strcpy( IRC_CONN->isupport.prefixes, close + 1 );
+}
+
+/* CHANMODES=beI,k,l,imnpst */
+static void isupport_chanmodes( const char *value )
+{
+   size_t i, n;
+
+   i = 0;
+   for(; i != 4; ++i)
+   {
+      n = strcspn( value, "," );
+      if(n >= sizeof(IRC_CONN->isupport.chanmodes[i])) n = 0;
+      memcpy( IRC_CONN->isupport.chanmodes[i], value, n );
+      IRC_CONN->isupport.chanmodes[i][n] = '\0';
+      value += strcspn( value, "," );
+      if(*value) ++value;
+   }
+}
+
+/* TARGMAX=PRIVMSG:4,JOIN:,PART:1 */
+static void isupport_targmax( const char *value )
+{
+   const char *colon;
+   size_t n, max;
+
+   while(*value)
+   {
+      n = strcspn( value, "," );
+      if((colon = memchr(value, ':', n)))
+      {
+         max = strtoul( colon + 1, NULL, 10 );
+         if(colon - value == 4 && !strncmp(value, HEADER_JOIN, 4)) IRC_CONN->isupport.maxjoin = max;
+         if(colon - value == 4 && !strncmp(value, HEADER_PART, 4)) IRC_CONN->isupport.maxpart = max;
+      }
+      value += n;
+      if(*value) ++value;
+   }
+}
+
+/* rfc7613 folds like ascii below 0x80, unknown ones get the default */
+static void isupport_casemap( const char *value )
+{
+   if(!strcmp(value, "ascii") || !strcmp(value, "rfc7613"))  IRC_CONN->isupport.casemap = CASEMAP_ASCII;
+   else if(!strcmp(value, "strict-rfc1459"))                 IRC_CONN->isupport.casemap = CASEMAP_STRICT;
+   else                                                      IRC_CONN->isupport.casemap = CASEMAP_RFC1459;
+}
+
+static void isupport_token( const char *key, const char *value )
+{
+   if(!value) value = "";
+
+   if(!strcmp(key, "NICKLEN") && atoi(value) > 0)         IRC_CONN->isupport.nicklen    = atoi(value);
+   else if(!strcmp(key, "USERLEN") && atoi(value) > 0)    IRC_CONN->isupport.userlen    = atoi(value);
+   else if(!strcmp(key, "HOSTLEN") && atoi(value) > 0)    IRC_CONN->isupport.hostlen    = atoi(value);
+   else if(!strcmp(key, "CHANNELLEN") && atoi(value) > 0) IRC_CONN->isupport.channellen = atoi(value);
+   else if(!strcmp(key, "MODES"))      IRC_CONN->isupport.modes = atoi(value); /* empty, no limit */
+   else if(!strcmp(key, "TARGMAX"))    isupport_targmax( value );
+   else if(!strcmp(key, "PREFIX"))     isupport_prefix( value );
+   else if(!strcmp(key, "CHANMODES"))  isupport_chanmodes( value );
+   else if(!strcmp(key, "CASEMAPPING")) isupport_casemap( value );
+   else if(!strcmp(key, "CHANTYPES") && strlen(value) < sizeof(IRC_CONN->isupport.chantypes))
+      strcpy( IRC_CONN->isupport.chantypes, value );
+}
+
+/* size the pools holding identities from the profile */
+static void isupport_apply(void)
+{
+   size_t target = IRC_CONN->isupport.nicklen > IRC_CONN->isupport.channellen ? IRC_CONN->isupport.nicklen : IRC_CONN->isupport.channellen;
+
+   /* records already out keep the old size, the pools switch once drained */
+   pool_resize( &IRC_CONN->nick_pool, sizeof(nick_t) + IRC_CONN->isupport.nicklen * 2 + IRC_CONN->isupport.userlen + IRC_CONN->isupport.hostlen + 4 );
+   pool_resize( &IRC_CONN->mode_pool, sizeof(pendmode_t) + IRC_CONN->isupport.nicklen + 1 );
+   pool_resize( &IRC_CONN->target_pool, sizeof(sendtarget_t) + target + 1 );
+
+   if(IRC_CONN->keymap != IRC_CONN->isupport.casemap || !IRC_CONN->me.name) rekey();
+}
+
+/* back to what we assume before the server tells */
+static void isupport_reset(void)
+{
+   memset( &IRC_CONN->isupport, 0, sizeof(isupport_t) );
+   IRC_CONN->isupport.nicklen    = NICKLEN_DEFAULT;
+   IRC_CONN->isupport.userlen    = USERLEN_DEFAULT;
+   IRC_CONN->isupport.hostlen    = HOSTLEN_DEFAULT;
+   IRC_CONN->isupport.channellen = CHANNELLEN_DEFAULT;
+   IRC_CONN->isupport.modes      = MODES_DEFAULT;
+   IRC_CONN->isupport.casemap    = CASEMAP_DEFAULT;
+   strcpy( IRC_CONN->isupport.chantypes, CHANTYPES_DEFAULT );
+   isupport_prefix( PREFIX_DEFAULT );
+   isupport_chanmodes( CHANMODES_DEFAULT );
+   isupport_apply();
+}
+
+/* 005 <me> TOKEN[=value] ... :are supported by this server */
+static void parseisupport( const ircmsg_t *msg )
+{
+   char *eq;
+   size_t i;
+
+   i = 1;
+   for(; i + 1 < msg->nparams; ++i)
+   {
+      if(msg->params[i][0] == '-') continue; /* negation, keep defaults */
+      if((eq = strchr(msg->params[i], '='))) *eq++ = '\0';
+      isupport_token( msg->params[i], eq );
+   }
+   isupport_apply();
+
+#if DEBUG
+   printf( "$ ISUPPORT nick %zu user %zu host %zu chan %zu modes %zu prefix (%s)%s\n",
+         IRC_CONN->isupport.nicklen, IRC_CONN->isupport.userlen, IRC_CONN->isupport.hostlen, IRC_CONN->isupport.channellen,
+         IRC_CONN->isupport.modes, IRC_CONN->isupport.prefixmodes, IRC_CONN->isupport.prefixes );
+#endif
+}
+
+static void parsebuffer( char *buffer )
+{
+   size_t i;
+   ircmsg_t msg;
+   uint64_t start = 0, parsed = 0;
+
+   if(IRC_STATS) start = now_ns();
+   if(ircparse( &msg, buffer ) != RETURN_OK)
+      return;
+   if(IRC_STATS) hist_add( &IRC_CONN->hist[ STAGE_PARSE ], (parsed = now_ns()) - start );
+
+   i = 0;
+   for(; i != LENGTH(IRC_HANDLER); ++i)
+   {
+      if(!strcmp(msg.command, IRC_HANDLER[i].command))
+      { IRC_HANDLER[i].function( &msg ); break; }
+   }
+   arena_reset( &IRC_CONN->arena );
+   if(!IRC_STATS) return;
+   start = now_ns() - parsed;
+   hist_add( &IRC_CONN->hist[ STAGE_DISPATCH ], start );
+   hist_add( &IRC_CONN->handler_hist[i], start );
+}
+
+/* keep what would have been sent */
+static void capture( capture_t *c, const char *line, size_t len )
+{
+   char *data;
+
+   if(c->len + len > c->cap)
+   {
+      if(!(data = xrealloc( c->data, (c->cap + len) * 2 ))) return;
+      c->data = data;
+      c->cap  = (c->cap + len) * 2;
+   }
+   memcpy( c->data + c->len, line, len );
+   c->len += len;
+   c->lines++;
+}
+
+/* every callback of a connection starts here */
+static ircconn_t* connenter( ircconn_t *c )
+{
+   c->active = 1;
+   return( IRC_CONN = c );
+}
+
+/* tokens are back, ircflush runs right after */
+static void ircpace( void *data )
+{
+   connenter( data )->pace = NULL;
+}
+
+/* flush output produced by the last round of events */
+static void ircflush(void)
+{
+   int wait;
+   uint64_t start = 0;
+
+   if(IRC_STATS) start = now_ns();
+   batchflush();
+   wait = sendq_flush( &IRC_CONN->sendq, IRC_CONN->socket );
+   if(IRC_STATS) hist_add( &IRC_CONN->hist[ STAGE_FLUSH ], now_ns() - start );
+   evloop_watch( IRC_CONN->loop, &IRC_CONN->watch, EPOLLIN | (IRC_CONN->sendq.blocked ? EPOLLOUT : 0) );
+   if(wait > 0 && !IRC_CONN->pace) IRC_CONN->pace = evloop_timer( IRC_CONN->loop, wait, ircpace, IRC_CONN );
+}
+
+/* shard tick, only connections that had events have anything to send */
+static void shardflush( void *data )
+{
+   shard_t *s = data;
+   ircconn_t *c;
+   size_t i;
+
+   i = 0;
+   for(; i != s->nconns; ++i)
+   {
+      c = s->conns[i];
+      if(!c->active) continue;
+      c->active = 0;
+      if(c->state != CONN_UP) continue;
+      IRC_CONN = c;
+      ircflush();
+   }
+}
+
+/* forget what belonged to the socket, members stay until NAMES says otherwise */
+static void connreset( ircconn_t *c )
+{
+   chan_t *ch;
+   size_t i;
+
+   IRC_CONN = c;
+   sendq_clear( &c->sendq );
+   memset( &c->recv, 0, sizeof(recvbuf_t) );
+   c->joins = c->parts = c->modeq = NULL;
+
+   i = 0;
+   for(; c->chans.slots && i != c->chans.mask + 1; ++i)
+   {
+      if(!(ch = c->chans.slots[i].value)) continue;
+      ch->state   = CHAN_PARTED; /* joinall picks the CHAN_AUTOJOIN ones up again */
+      ch->batch   = ch->mbatch = NULL;
+      ch->mqueued = 0;
+      modeclear( ch );
+      dropnames( ch ); /* NAMES cut short */
+   }
+}
+
+/* socket lost, try again after a jittered exponential backoff,
+ * the shard stops once it has no connection left */
+static void connclose( ircconn_t *c )
+{
+   uint64_t delay;
+
+   if(c->state == CONN_WAIT || c->state == CONN_DEAD) return;
+   dialclear( c );
+   evloop_cancel( c->loop, c->pace );
+   evloop_cancel( c->loop, c->ping );
+   c->pace = c->ping = NULL;
+   if(c->socket != -1)
+   {
+      evloop_unwatch( c->loop, &c->watch );
+      close(c->socket);
+      c->socket = -1;
+   }
+   connreset( c );
+
+#if RECONNECT_TRIES
+   if(c->retries >= RECONNECT_TRIES)
+   {
+      printf("-!- %s: Giving up\n", c->net->name);
+      c->state = CONN_DEAD;
+      if(!--c->shard->live) c->loop->running = 0;
+      return;
+   }
+#endif
+
+   delay = (uint64_t)RECONNECT_MIN << (c->retries < 16 ? c->retries : 16);
+   if(delay > RECONNECT_MAX) delay = RECONNECT_MAX;
+   delay = delay / 2 + rand_r( &c->seed ) % (delay / 2 + 1);
+   c->retries++;
+   c->state = CONN_WAIT;
+   c->retry = evloop_timer( c->loop, delay, connretry, c );
+   printf("-!- %s: Reconnecting in %llu ms\n", c->net->name, (unsigned long long)delay);
+}
+
+static void ircread( watch_t *w, uint32_t events )
+{
+   ssize_t bytes;
+   uint64_t start = 0;
+
+   connenter( w->data ); /* marked active, the tick flushes and re-arms */
+   if(!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+      return; /* writable, ircflush takes care */
+
+   if(IRC_STATS) start = now_ns();
+   bytes = recvbuf_read( &IRC_CONN->recv, w->fd );
+   if(bytes < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) return;
+   if(bytes <= 0) { connclose( IRC_CONN ); return; } /* something is wrong */
+   if(IRC_STATS) hist_add( &IRC_CONN->hist[ STAGE_RECV ], now_ns() - start );
+   IRC_CONN->metrics.recv_bytes += bytes;
+   IRC_CONN->metrics.recv_calls++;
+
+   IRC_CONN->lastrecv = now_ms();
+   recvbuf_drain( &IRC_CONN->recv, parsebuffer );
+}
+
+static void pingcheck( void *data )
+{
+   ircconn_t *c = connenter( data );
+   uint64_t idle = now_ms() - c->lastrecv;
+
+   c->ping = NULL;
+   floodsweep( now_ms() );
+   if(idle >= PING_TIMEOUT)
+   {
+      printf("-!- %s: Ping timeout\n", c->net->name);
+      connclose( c );
+      return;
+   }
+   if(idle >= PING_INTERVAL)
+      sendq_printf( &c->sendq, PRIO_URGENT, NULL, HEADER_PING" :%s", c->net->nick );
+   c->ping = evloop_timer( c->loop, PING_INTERVAL / 4, pingcheck, c );
+}
+
+/* state for one network, channels from IRC_CHANNELS */
+static ircconn_t* connnew( const netconf_t *net, shard_t *s )
+{
+   ircconn_t *c;
+   size_t i;
+
+   if(!(c = xcalloc( 1, sizeof(ircconn_t) ))) return NULL;
+   if((c->resolved.fd = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC )) == -1) { xfree(c); return NULL; }
+   c->resolved.function = connresolved;
+   c->resolved.data     = c;
+   for(i = 0; i != CONNECT_MAX; ++i) c->dial[i].fd = -1;
+   c->net    = net;
+   c->shard  = s;
+   c->loop   = &s->loop;
+   c->socket = c->store = c->store_proc.fd = -1;
+   c->chan_pool   = (pool_t)POOL_INIT( chan_t, 16 );
+   c->nick_pool   = (pool_t)POOL_INIT( nick_t, 128 );
+   c->usr_pool    = (pool_t)POOL_INIT( usr_t, 128 );
+   c->mode_pool   = (pool_t)POOL_INIT( pendmode_t, 32 );
+   c->ban_pool    = (pool_t)POOL_INIT( ban_t, 64 );
+   c->line_pool   = (pool_t)POOL_INIT( sendline_t, 32 );
+   c->target_pool = (pool_t)POOL_INIT( sendtarget_t, 16 );
+   c->job_pool    = (pool_t)POOL_INIT( job_t, SH_JOBS_MAX );
+   c->flood_pool  = (pool_t)POOL_INIT( floodrec_t, 64 );
+
+   IRC_CONN = c;
+   snprintf( c->menick, sizeof(c->menick), "%s", net->nick );
+   isupport_reset();
+   i = 0;
+   for(; i != LENGTH(IRC_CHANNELS); ++i)
+      if(!IRC_CHANNELS[i].network || !strcmp(IRC_CHANNELS[i].network, net->name))
+         addchan( IRC_CHANNELS[i].name, IRC_CHANNELS[i].flags );
+
+   s->conns[ s->nconns++ ] = c;
+   return c;
+}
+
+/* connected, registration goes through the send queue */
+static int connup( ircconn_t *c )
+{
+   c->watch.fd       = c->socket;
+   c->watch.function = ircread;
+   c->watch.data     = c;
+   if(evloop_watch( c->loop, &c->watch, EPOLLIN ) != RETURN_OK) return( RETURN_FAIL );
+
+   c->state        = CONN_UP;
+   c->sendq.stamp  = now_ms();
+   c->sendq.budget = SENDQ_BURST * SENDQ_INTERVAL;
+   c->lastrecv     = now_ms();
+   c->ping         = evloop_timer( c->loop, PING_INTERVAL / 4, pingcheck, c );
+   return( RETURN_OK );
+}
+
+/* runs on the shard, before its loop */
+static void connstart( ircconn_t *c )
+{
+   pthread_mutex_lock( &c->shard->lock );
+   connenter( c );
+   c->seed = (unsigned int)(now_ns() ^ (uintptr_t)c);
+   c->shard->live++;
+   if(ircconnect( c ) != RETURN_OK) connclose( c );
+   pthread_mutex_unlock( &c->shard->lock );
+}
+
+/* backoff ran out */
+static void connretry( void *data )
+{
+   ircconn_t *c = connenter( data );
+
+   c->retry = NULL;
+   c->metrics.reconnects++;
+   isupport_reset(); /* the next server may differ */
+   if(ircconnect( c ) != RETURN_OK) connclose( c );
+}
+
+static void connfree( ircconn_t *c )
+{
+   job_t *job;
+   size_t i;
+
+   IRC_CONN = c;
+
+   /* children still running get killed, not waited for */
+   i = 0;
+   for(; i != c->jobs_count; ++i)
+   {
+      job = c->jobs_running[i];
+      if(job->pid > 0 && !job->exited) { kill( -job->pid, SIGKILL ); waitpid( job->pid, NULL, 0 ); }
+   }
+   c->jobs_count = 0;
+   c->jobs = c->jobs_last = NULL;
+   pool_clear( &c->job_pool );
+   store_close();
+
+   sendq_clear( &c->sendq );
+   pool_clear( &c->line_pool );
+   pool_clear( &c->target_pool );
+   clearbans();
+   clearusrs();
+   hmap_clear( &c->floods );
+   pool_clear( &c->flood_pool );
+   arena_clear( &c->arena );
+   if(c->resolving) { pthread_join( c->resolver, NULL ); c->resolving = 0; } /* getaddrinfo can not be cancelled */
+   dialclear( c );
+   if(c->resolved.fd != -1) close(c->resolved.fd);
+   if(c->socket != -1) close(c->socket);
+   IRC_CONN = NULL;
+   xfree(c);
+}
+
+static void shardwake( watch_t *w, uint32_t events )
+{
+   uint64_t n;
+
+   (void)events;
+   if(read(w->fd, &n, sizeof(n)) < 0) return;
+   ((shard_t*)w->data)->loop.running = 0;
+}
+
+static int shardinit( shard_t *s, size_t nconns )
+{
+   memset( s, 0, sizeof(shard_t) );
+   s->wake.fd = -1;
+   pthread_mutex_init( &s->lock, NULL );
+   if(evloop_init( &s->loop ) != RETURN_OK) return( RETURN_FAIL );
+   if(!(s->conns = xcalloc( nconns, sizeof(ircconn_t*) ))) return( RETURN_FAIL );
+   s->loop.lock = &s->lock;
+   s->loop.tick = shardflush;
+   s->loop.data = s;
+
+   s->wake.fd       = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+   s->wake.function = shardwake;
+   s->wake.data     = s;
+   if(s->wake.fd == -1 || evloop_watch( &s->loop, &s->wake, EPOLLIN ) != RETURN_OK)
+      return( RETURN_FAIL );
+   return( RETURN_OK );
+}
+
+static void* shardrun( void *data )
+{
+   shard_t *s = data;
+   uint64_t one = 1;
+   size_t i;
+
+   i = 0;
+   for(; i != s->nconns; ++i) connstart( s->conns[i] );
+
+   if(s->live) evloop_run( &s->loop );
+
+   /* tell main we are done */
+   if(write(IRC_DONE.fd, &one, sizeof(one)) < 0) {}
+   return NULL;
+}
+
+static void shardstop( shard_t *s )
+{
+   uint64_t one = 1;
+
+   if(!s->started) return;
+   if(write(s->wake.fd, &one, sizeof(one)) < 0) {}
+   pthread_join( s->thread, NULL );
+   s->started = 0;
+}
+
+static void shardfree( shard_t *s )
+{
+   size_t i;
+
+   i = 0;
+   for(; i != s->nconns; ++i) connfree( s->conns[i] );
+   s->nconns = 0;
+   xfree(s->conns);
+   evloop_free( &s->loop );
+   if(s->wake.fd != -1) close(s->wake.fd);
+   pthread_mutex_destroy( &s->lock );
+}
+
+/* main loop, a shard ran out of connections */
+static void sharddone( watch_t *w, uint32_t events )
+{
+   uint64_t n;
+
+   (void)events;
+   if(read(w->fd, &n, sizeof(n)) < 0) return;
+   if((IRC_NDONE += n) >= IRC_NSHARDS) IRC_LOOP.running = 0;
+}
+
+static void hist_write( FILE *f, const char *net, const char *name, const char *label, const char *value, const hist_t *h )
+{
+   static const double pct[] = { 50, 90, 99 };
+   size_t i;
+
+   i = 0;
+   for(; i != LENGTH(pct); ++i)
+      fprintf( f, "lightbot_%s_ns{net=\"%s\",%s=\"%s\",quantile=\"%g\"} %llu\n", name, net, label, value,
+            pct[i] / 100, (unsigned long long)hist_pct( h, pct[i] ) );
+   fprintf( f, "lightbot_%s_ns{net=\"%s\",%s=\"%s\",quantile=\"1\"} %llu\n", name, net, label, value, (unsigned long long)h->max );
+   fprintf( f, "lightbot_%s_ns_sum{net=\"%s\",%s=\"%s\"} %llu\n", name, net, label, value, (unsigned long long)h->sum );
+   fprintf( f, "lightbot_%s_ns_count{net=\"%s\",%s=\"%s\"} %llu\n", name, net, label, value, (unsigned long long)h->count );
+}
+
+static void counter_write( FILE *f, const char *net, const char *event, uint64_t n )
+{
+   fprintf( f, "lightbot_events_total{net=\"%s\",event=\"%s\"} %llu\n", net, event, (unsigned long long)n );
+}
+
+static void gauge_write( FILE *f, const char *net, const char *what, uint64_t n )
+{
+   fprintf( f, "lightbot_gauge{net=\"%s\",what=\"%s\"} %llu\n", net, what, (unsigned long long)n );
+}
+
+/* Prometheus text format, every family grouped across the networks.
+ * The shards are held still meanwhile. */
+static void metrics_write( FILE *f )
+{
+   const ircconn_t *conn;
+   const metrics_t *m;
+   const job_t *job;
+   const chan_t *c;
+   const char *net;
+   size_t i, n, bans, queued;
+
+   for(i = 0; i != IRC_NSHARDS; ++i) pthread_mutex_lock( &IRC_SHARDS[i].lock );
+
+   fprintf( f, "# TYPE lightbot_latency_ns summary\n" );
+   for(n = 0; n != LENGTH(IRC_CONNS); ++n)
+      for(i = 0; (conn = IRC_CONNS[n]) && i != STAGE_MAX; ++i)
+         hist_write( f, conn->net->name, "latency", "stage", STAGE_NAME[i], &conn->hist[i] );
+
+   fprintf( f, "# TYPE lightbot_dispatch_ns summary\n" );
+   for(n = 0; n != LENGTH(IRC_CONNS); ++n)
+      for(i = 0; (conn = IRC_CONNS[n]) && i != LENGTH(IRC_HANDLER) + 1; ++i)
+         if(conn->handler_hist[i].count)
+            hist_write( f, conn->net->name, "dispatch", "command", i == LENGTH(IRC_HANDLER) ? "other" : IRC_HANDLER[i].command, &conn->handler_hist[i] );
+
+   fprintf( f, "# TYPE lightbot_op_ns summary\n" );
+   for(n = 0; n != LENGTH(IRC_CONNS); ++n)
+   {
+      if(!(conn = IRC_CONNS[n])) continue;
+      m = &conn->metrics; net = conn->net->name;
+      hist_write( f, net, "op", "op", "usr_lookup", &m->usr_lookup );
+      hist_write( f, net, "op", "op", "ban_check", &m->ban_check );
+      hist_write( f, net, "op", "op", "sendq_wait", &m->sendq_wait );
+      hist_write( f, net, "op", "op", "job", &m->job_time );
+   }
+
+   fprintf( f, "# TYPE lightbot_events_total counter\n" );
+   for(n = 0; n != LENGTH(IRC_CONNS); ++n)
+   {
+      if(!(conn = IRC_CONNS[n])) continue;
+      m = &conn->metrics; net = conn->net->name;
+      counter_write( f, net, "recv_bytes", m->recv_bytes );
+      counter_write( f, net, "recv_calls", m->recv_calls );
+      counter_write( f, net, "usr_hit", m->usr_hits );
+      counter_write( f, net, "usr_miss", m->usr_misses );
+      counter_write( f, net, "ban_check", m->ban_checks );
+      counter_write( f, net, "ban_hit", m->ban_hits );
+      counter_write( f, net, "sent_lines", m->sent_lines );
+      counter_write( f, net, "sent_bytes", m->sent_bytes );
+      counter_write( f, net, "send_calls", m->send_calls );
+      counter_write( f, net, "job_started", m->jobs_started );
+      counter_write( f, net, "job_killed", m->jobs_killed );
+      counter_write( f, net, "job_failed", m->jobs_failed );
+      counter_write( f, net, "flood_warn", m->flood_warns );
+      counter_write( f, net, "flood_drop", m->flood_drops );
+      counter_write( f, net, "flood_kick", m->flood_kicks );
+      counter_write( f, net, "flood_ban", m->flood_bans );
+      counter_write( f, net, "reconnects", m->reconnects );
+   }
+   fprintf( f, "lightbot_events_total{event=\"alloc\"} %llu\n", (unsigned long long)IRC_MEM.allocs );
+   fprintf( f, "lightbot_events_total{event=\"free\"} %llu\n", (unsigned long long)IRC_MEM.frees );
+
+   fprintf( f, "# TYPE lightbot_gauge gauge\n" );
+   for(n = 0; n != LENGTH(IRC_CONNS); ++n)
+   {
+      if(!(conn = IRC_CONNS[n])) continue;
+      m = &conn->metrics; net = conn->net->name;
+      bans = queued = 0;
+      for(i = 0; conn->chans.slots && i != conn->chans.mask + 1; ++i)
+         if((c = conn->chans.slots[i].value)) bans += c->bans.count;
+      for(job = conn->jobs; job; job = job->next) queued++;
+
+      gauge_write( f, net, "connected", conn->watch.added );
+      gauge_write( f, net, "sendq_depth", conn->sendq.depth );
+      gauge_write( f, net, "sendq_depth_max", m->sendq_max );
+      gauge_write( f, net, "jobs_running", conn->jobs_count );
+      gauge_write( f, net, "jobs_queued", queued );
+      gauge_write( f, net, "channels", conn->chans.count );
+      gauge_write( f, net, "users", conn->nicks.count );
+      gauge_write( f, net, "memberships", conn->usrs.count );
+      gauge_write( f, net, "bans", bans );
+   }
+
+   for(i = 0; i != IRC_NSHARDS; ++i) pthread_mutex_unlock( &IRC_SHARDS[i].lock );
+}
+
+/* every connection gets one scrape, then it is closed */
+static void ctlaccept( watch_t *w, uint32_t events )
+{
+   char *text = NULL;
+   size_t len = 0;
+   FILE *f;
+   int fd;
+
+   (void)events;
+   if((fd = accept4(w->fd, NULL, NULL, SOCK_CLOEXEC)) == -1) return;
+   if((f = open_memstream(&text, &len)))
+   {
+      metrics_write( f );
+      fclose(f);
+      /* never wait on a slow reader, it gets what fits */
+      if(send(fd, text, len, MSG_DONTWAIT | MSG_NOSIGNAL) < 0) {}
+      free(text); /* open_memstream, not ours */
+   }
+   close(fd);
+}
+
+static int ctlopen( const char *path )
+{
+   struct sockaddr_un addr;
+
+   memset( &addr, 0, sizeof(addr) );
+   addr.sun_family = AF_UNIX;
+   if(strlen(path) >= sizeof(addr.sun_path)) return( RETURN_FAIL );
+   strcpy( addr.sun_path, path );
+
+   unlink(path);
+   if((IRC_CONTROL.fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0)) == -1)
+      return( RETURN_FAIL );
+   IRC_CONTROL.function = ctlaccept;
+   if(bind(IRC_CONTROL.fd, (struct sockaddr*)&addr, sizeof(addr)) != 0 ||
+      listen(IRC_CONTROL.fd, 4) != 0 ||
+      evloop_watch( &IRC_LOOP, &IRC_CONTROL, EPOLLIN ) != RETURN_OK)
+   { close(IRC_CONTROL.fd); IRC_CONTROL.fd = -1; return( RETURN_FAIL ); }
+   return( RETURN_OK );
+}
+
+static void sigread( watch_t *w, uint32_t events )
+{
+   struct signalfd_siginfo info;
+
+   (void)events;
+   if(read(w->fd, &info, sizeof(info)) != sizeof(info)) return;
+   if(info.ssi_signo == SIGUSR1) { metrics_write( stdout ); fflush(stdout); return; }
+   printf("-!- Caught signal %u\n", info.ssi_signo);
+   IRC_LOOP.running = 0;
+}
+
+/* Feeds recorded raw traffic through framing, parsing and commands as
+ * if it came off the socket, REPLAY_CHUNK bytes per simulated recv.
+ * Output is captured in memory, written to out when given. */
+static int replay( const char *path, unsigned loops, const char *out )
+{
+   capture_t cap = { NULL, 0, 0, 0 };
+   memstat_t mem;
+   FILE *f;
+   char *data, *space;
+   size_t size, off, len;
+   uint64_t start, lines, t;
+   double secs;
+   unsigned n;
+   size_t i;
+
+   if(!(f = fopen(path, "rb")))
+   { printf("-!- Cannot open %s\n", path); return( RETURN_FAIL ); }
+   fseek( f, 0, SEEK_END );
+   size = ftell( f );
+   fseek( f, 0, SEEK_SET );
+   if(!(data = xmalloc( size + 1 )) || fread( data, 1, size, f ) != size)
+   { fclose(f); xfree(data); puts("-!- Cannot read replay"); return( RETURN_FAIL ); }
+   fclose(f);
+
+   IRC_CONN->capture       = &cap;
+   IRC_CONN->sendq.unpaced = 1;
+   memcpy( &mem, &IRC_MEM, sizeof(memstat_t) );
+
+   start = now_ns();
+   n = 0;
+   for(; n != loops; ++n)
+   {
+      for(off = 0; off < size; off += len)
+      {
+         t = now_ns();
+         space = recvbuf_space( &IRC_CONN->recv, &len );
+         if(len > REPLAY_CHUNK) len = REPLAY_CHUNK;
+         if(len > size - off)   len = size - off;
+         memcpy( space, data + off, len );
+         IRC_CONN->recv.tail += len;
+         IRC_CONN->metrics.recv_bytes += len;
+         IRC_CONN->metrics.recv_calls++;
+         hist_add( &IRC_CONN->hist[ STAGE_RECV ], now_ns() - t );
+
+         recvbuf_drain( &IRC_CONN->recv, parsebuffer );
+
+         t = now_ns();
+         batchflush();
+         sendq_flush( &IRC_CONN->sendq, -1 );
+         hist_add( &IRC_CONN->hist[ STAGE_FLUSH ], now_ns() - t );
+      }
+   }
+   secs  = (now_ns() - start) / 1e9;
+   lines = IRC_CONN->hist[ STAGE_FRAME ].count;
+
+   printf("-!- Replayed %llu lines (%zu bytes x %u) in %.3f s, %.0f lines/s\n",
+         (unsigned long long)lines, size, loops, secs, secs > 0 ? lines / secs : 0.0);
+   printf("-!- Sent %llu lines (%zu bytes)\n", (unsigned long long)cap.lines, cap.len);
+   printf("-!- %-10s %10s %8s %8s %8s %8s %10s (ns)\n", "stage", "count", "mean", "p50", "p90", "p99", "max");
+   i = 0;
+   for(; i != STAGE_MAX; ++i)
+      printf("-!- %-10s %10llu %8llu %8llu %8llu %8llu %10llu\n", STAGE_NAME[i],
+            (unsigned long long)IRC_CONN->hist[i].count,
+            (unsigned long long)(IRC_CONN->hist[i].count ? IRC_CONN->hist[i].sum / IRC_CONN->hist[i].count : 0),
+            (unsigned long long)hist_pct( &IRC_CONN->hist[i], 50 ),
+            (unsigned long long)hist_pct( &IRC_CONN->hist[i], 90 ),
+            (unsigned long long)hist_pct( &IRC_CONN->hist[i], 99 ),
+            (unsigned long long)IRC_CONN->hist[i].max);
+   printf("-!- Allocations: %llu alloc, %llu realloc, %llu free\n",
+         (unsigned long long)(IRC_MEM.allocs   - mem.allocs),
+         (unsigned long long)(IRC_MEM.reallocs - mem.reallocs),
+         (unsigned long long)(IRC_MEM.frees    - mem.frees));
+
+   if(out && (f = fopen(out, "wb")))
+   { if(cap.len) fwrite( cap.data, 1, cap.len, f ); fclose(f); }
+
+   IRC_CONN->capture = NULL;
+   xfree(cap.data);
+   xfree(data);
+   return( RETURN_OK );
+}
+
+static void cleanup( int ret )
+{
+   size_t i;
+
+   i = 0;
+   for(; i != IRC_NSHARDS; ++i) shardstop( &IRC_SHARDS[i] );
+   i = 0;
+   for(; i != IRC_NSHARDS; ++i) shardfree( &IRC_SHARDS[i] );
+   memset( IRC_CONNS, 0, sizeof(IRC_CONNS) );
+   xfree(IRC_SHARDS);
+   IRC_SHARDS  = NULL;
+   IRC_NSHARDS = 0;
+
+   evloop_free( &IRC_LOOP );
+   if(IRC_CONTROL.fd != -1) { close(IRC_CONTROL.fd); unlink(BOT_CONTROL); }
+   IRC_CONTROL.fd = -1;
+   if(IRC_SIGNAL.fd > 0) close(IRC_SIGNAL.fd);
+   IRC_SIGNAL.fd = 0;
+   if(IRC_DONE.fd > 0) close(IRC_DONE.fd);
+   IRC_DONE.fd = 0;
+   hmap_clear( &IRC_CMD );
+   exit(ret);
+}
+
+/* SIGSEGV, the other loops are still running, only let go of the outside */
+static void crash( int sig )
+{
+   const ircconn_t *c;
+   size_t n, i;
+
+   (void)sig;
+   for(n = 0; n != LENGTH(IRC_CONNS); ++n)
+   {
+      if(!(c = IRC_CONNS[n])) continue;
+      for(i = 0; i != c->jobs_count; ++i)
+         if(c->jobs_running[i]->pid > 0) kill( -c->jobs_running[i]->pid, SIGKILL );
+      if(c->socket != -1) close(c->socket);
+   }
+   _exit( EXIT_FAILURE );
+}
+
+static void usage( const char *name )
+{
+   printf("usage: %s [-r replay.log [-n loops] [-o sent.log]]\n", name);
+}
+
+int main(int argc, char *argv[])
+{
+   sigset_t mask;
+   size_t i, nconns, nshards;
+   long online;
+   const char *replayfile = NULL, *outfile = NULL;
+   unsigned loops = 1;
+   int opt;
+
+   while((opt = getopt(argc, argv, "r:n:o:h")) != -1)
+   {
+      switch(opt)
+      {
+         case 'r': replayfile = optarg; break;
+         case 'n': loops = strtoul(optarg, NULL, 10); break;
+         case 'o': outfile = optarg; break;
+         default:  usage( argv[0] ); return( EXIT_FAILURE );
+      }
+   }
+
+   (void)signal(SIGSEGV, crash);
+
+   /* SIGINT and SIGTERM are read from the main loop, the shards inherit the mask */
+   sigemptyset( &mask );
+   sigaddset( &mask, SIGINT );
+   sigaddset( &mask, SIGTERM );
+   sigaddset( &mask, SIGUSR1 ); /* metrics dump */
+   sigprocmask( SIG_BLOCK, &mask, NULL );
+
+   if(evloop_init( &IRC_LOOP ) != RETURN_OK || cmd_init() != RETURN_OK ||
+      tmpl_init() != RETURN_OK)
+      cleanup( EXIT_FAILURE );
+   casemap_init();
+
+   IRC_SIGNAL.fd       = signalfd( -1, &mask, SFD_NONBLOCK | SFD_CLOEXEC );
+   IRC_SIGNAL.function = sigread;
+   if(IRC_SIGNAL.fd == -1 || evloop_watch( &IRC_LOOP, &IRC_SIGNAL, EPOLLIN ) != RETURN_OK)
+      cleanup( EXIT_FAILURE );
+   IRC_DONE.fd       = eventfd( 0, EFD_NONBLOCK | EFD_CLOEXEC );
+   IRC_DONE.function = sharddone;
+   if(IRC_DONE.fd == -1 || evloop_watch( &IRC_LOOP, &IRC_DONE, EPOLLIN ) != RETURN_OK)
+      cleanup( EXIT_FAILURE );
+
+   /* one shard per core, never more than networks */
+   nconns  = replayfile ? 1 : LENGTH(IRC_NETWORKS);
+   online  = EVLOOP_SHARDS ? EVLOOP_SHARDS : sysconf( _SC_NPROCESSORS_ONLN );
+   nshards = online < 1 ? 1 : (size_t)online;
+   if(nshards > nconns) nshards = nconns;
+   if(!(IRC_SHARDS = xcalloc( nshards, sizeof(shard_t) )))
+      cleanup( EXIT_FAILURE );
+   while(IRC_NSHARDS != nshards)
+      if(shardinit( &IRC_SHARDS[ IRC_NSHARDS++ ], nconns ) != RETURN_OK)
+         cleanup( EXIT_FAILURE );
+
+   i = 0;
+   for(; i != nconns; ++i)
+      if(!(IRC_CONNS[i] = connnew( &IRC_NETWORKS[i], &IRC_SHARDS[ i % nshards ] )))
+         cleanup( EXIT_FAILURE );
+
+   if(replayfile)
+   {
+      IRC_CONN = IRC_CONNS[0];
+      cleanup( replay( replayfile, loops, outfile ) == RETURN_OK ? EXIT_SUCCESS : EXIT_FAILURE );
+   }
+
+   i = 0;
+   for(; i != nconns; ++i)
+   {
+      IRC_CONN = IRC_CONNS[i];
+      store_open(); /* stored settings win over IRC_CHANNELS */
+   }
+   IRC_CONN = NULL;
+   if(ctlopen( BOT_CONTROL ) != RETURN_OK) printf("-!- Cannot open %s\n", BOT_CONTROL);
+
+   i = 0;
+   for(; i != IRC_NSHARDS; ++i)
+   {
+      if(pthread_create( &IRC_SHARDS[i].thread, NULL, shardrun, &IRC_SHARDS[i] ) != 0)
+         cleanup( EXIT_FAILURE );
+      IRC_SHARDS[i].started = 1;
+   }
+   evloop_run( &IRC_LOOP );
+
    puts("-! Closing");
    cleanup( EXIT_SUCCESS );
    return( EXIT_SUCCESS ); /* should be never called */